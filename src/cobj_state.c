@@ -28,6 +28,7 @@
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
 #include <tcl.h>
 #include "variable_state.h"
 #include "cobj_state.h"
@@ -44,6 +45,583 @@ int  cObjCmd(ClientData data, Tcl_Interp *interp, int objc,
 int  cObjCreate(ClientData data, Tcl_Interp *interp, int objc, 
 		Tcl_Obj *CONST objv[]);
 void cObjDelete(void *ptr);
+static int cObjTeardown(ClientData element);
+static int cObjDeleteCheck(ClientData element);
+int  cObjInvoke(ClientData data, Tcl_Interp *interp, int objc, 
+		Tcl_Obj *CONST objv[]);
+int  cObjConfigure(ClientData data, Tcl_Interp *interp, int objc, 
+		Tcl_Obj *CONST objv[]);
+int  cObjForEachCmd(ClientData data, Tcl_Interp *interp, int objc, 
+		Tcl_Obj *CONST objv[]);
+int  cObjMemoryCmd(ClientData data, Tcl_Interp *interp, int objc, 
+		Tcl_Obj *CONST objv[]);
+int  cObjTransferCmd(ClientData data, Tcl_Interp *interp, int objc, 
+		Tcl_Obj *CONST objv[]);
+static void cObjPortAdd(Tcl_Interp *interp);
+
+/* Tcl_GetChild() is new in 8.7 */
+#if TCL_MAJOR_VERSION==8 && TCL_MINOR_VERSION<7
+#define Tcl_GetChild Tcl_GetSlave
+#endif
+
+/* Objects made by "cobj create" live in blocks holding both the cObj
+ * and the client data of its instance command, and room for a small
+ * payload constructed in place. Blocks are padded to a
+ * multiple of the cache line, carved out of slabs, and recycled through
+ * a free list kept in the per-interpreter context. */
+#define COBJ_CACHE_LINE 64
+#define COBJ_SLAB_BLOCKS 64
+
+typedef struct cObjBlock {
+	cObj obj; /* must come first */
+	ObjCmdClientData cdata;
+	struct cObjStateContext *ctx; /* pool the block belongs to */
+	VarHandle handle; /* registry handle, while registered */
+	uint64_t retained; /* references taken by the retain subcommand */
+	struct cObjBlock *nextFree; /* free list link while unused */
+	union {
+		unsigned char bytes[COBJ_INLINE_SIZE];
+		long double align;
+		void *ptr;
+	} storage; /* must come last, see cObjInlineStorage() */
+} cObjBlock;
+
+#define COBJ_BLOCK_SIZE \
+	((sizeof(cObjBlock)+COBJ_CACHE_LINE-1)&~(size_t)(COBJ_CACHE_LINE-1))
+
+/* per-interpreter data of the cobj layer, kept in StateManager_s::ext.
+ * A shared registry has one more in its root, whose pool all the views
+ * allocate from; its lists are guarded by lock. */
+struct cObjStateContext {
+	char **slabs; /* as returned by ckalloc, i.e. before alignment */
+	int num_slabs, max_slabs;
+	cObjBlock *free_blocks;
+	long num_blocks;
+	long in_use;
+	int orphaned; /* the state is gone, free once in_use drops to 0 */
+	int commands; /* give new objects an instance command, see cobj configure */
+	int shared; /* the pool of a shared registry */
+	int teardown; /* objects are being freed from several threads */
+	Tcl_Mutex lock;
+};
+
+#define CONTEXT(statePtr) ((struct cObjStateContext*)(statePtr)->ext)
+/* the pool objects of a state are allocated from */
+#define POOL(statePtr) CONTEXT((statePtr)->root)
+
+#define POOL_LOCK(ctx) if ((ctx)->shared || (ctx)->teardown) Tcl_MutexLock(&(ctx)->lock)
+#define POOL_UNLOCK(ctx) if ((ctx)->shared || (ctx)->teardown) Tcl_MutexUnlock(&(ctx)->lock)
+
+static void cObjPoolGrow(struct cObjStateContext *ctx, long nblocks)
+{
+	char *raw, *base;
+	long i;
+	cObjBlock *b;
+	raw=ckalloc(nblocks*COBJ_BLOCK_SIZE+COBJ_CACHE_LINE-1);
+	base=(char*)(((uintptr_t)raw+COBJ_CACHE_LINE-1)
+			&~(uintptr_t)(COBJ_CACHE_LINE-1));
+	if (ctx->num_slabs==ctx->max_slabs) {
+		ctx->max_slabs=ctx->max_slabs ? 2*ctx->max_slabs : 16;
+		ctx->slabs=(char**)ckrealloc((char*)ctx->slabs,ctx->max_slabs*sizeof(char*));
+	}
+	ctx->slabs[ctx->num_slabs++]=raw;
+	/* chain the new blocks in address order in front of the free list */
+	for (i=nblocks-1;i>=0;i--) {
+		b=(cObjBlock*)(base+i*COBJ_BLOCK_SIZE);
+		b->nextFree=ctx->free_blocks;
+		ctx->free_blocks=b;
+	}
+	ctx->num_blocks+=nblocks;
+}
+
+/* make sure count blocks are free */
+static void cObjPoolReserve(struct cObjStateContext *ctx, long count)
+{
+	cObjBlock *b=NULL;
+	long spare=0;
+	POOL_LOCK(ctx);
+	for (b=ctx->free_blocks;b!=NULL && spare<count;b=b->nextFree) spare++;
+	if (spare<count) cObjPoolGrow(ctx,count-spare);
+	POOL_UNLOCK(ctx);
+}
+
+static cObjBlock *cObjBlockAlloc(struct cObjStateContext *ctx)
+{
+	cObjBlock *b;
+	POOL_LOCK(ctx);
+	if (ctx->free_blocks==NULL) cObjPoolGrow(ctx,COBJ_SLAB_BLOCKS);
+	b=ctx->free_blocks;
+	ctx->free_blocks=b->nextFree;
+	ctx->in_use++;
+	POOL_UNLOCK(ctx);
+	memset(b,0,offsetof(cObjBlock,storage));
+	b->obj.flags=COBJ_FLAG_POOLED;
+	b->ctx=ctx;
+	return b;
+}
+
+static void cObjContextRelease(struct cObjStateContext *ctx)
+{
+	int i;
+	for (i=0;i<ctx->num_slabs;i++) ckfree(ctx->slabs[i]);
+	ckfree((char*)ctx->slabs);
+	ckfree((char*)ctx);
+}
+
+static void cObjBlockFree(cObjBlock *b)
+{
+	struct cObjStateContext *ctx=b->ctx;
+	POOL_LOCK(ctx);
+	b->nextFree=ctx->free_blocks;
+	ctx->free_blocks=b;
+	ctx->in_use--;
+	POOL_UNLOCK(ctx);
+	/* the pool of a shared registry is never orphaned */
+	if (ctx->orphaned && ctx->in_use==0) cObjContextRelease(ctx);
+}
+
+/* called with the state itself, once nothing references it any more.
+ * Objects still retained through cObjRetain() keep their slabs alive. */
+static void cObjContextFree(char *ptr)
+{
+	struct cObjStateContext *ctx=(struct cObjStateContext*)ptr;
+	if (ctx->in_use>0) {
+		ctx->orphaned=1;
+		return;
+	}
+	cObjContextRelease(ctx);
+}
+
+int cObjGetPoolInfo(Tcl_Interp *interp, cObjPoolInfo *infoPtr)
+{
+	StateManager_t statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	struct cObjStateContext *ctx=NULL;
+	if (statePtr==NULL || statePtr->ext==NULL) {
+		Tcl_AppendResult(interp,"No state stored by key `",COBJSTATEKEY,"'\n",NULL);
+		return TCL_ERROR;
+	}
+	ctx=POOL(statePtr);
+	POOL_LOCK(ctx);
+	infoPtr->slabs=ctx->num_slabs;
+	infoPtr->blocks=ctx->num_blocks;
+	infoPtr->in_use=ctx->in_use;
+	POOL_UNLOCK(ctx);
+	infoPtr->block_size=COBJ_BLOCK_SIZE;
+	return TCL_OK;
+}
+
+/* The deleteFuncs of COBJ_TYPE_ASYNC_DELETE types run on one background
+ * thread, started on first use and shared by all interpreters. Without
+ * thread support they simply run synchronously. */
+typedef struct cObjReclaim {
+	void (*deleteFunc)(void *ptr);
+	void *object;
+	struct cObjReclaim *next;
+} cObjReclaim;
+
+TCL_DECLARE_MUTEX(reclaimMutex)
+static Tcl_Condition reclaimWorkCond; /* work queued, or time to stop */
+static Tcl_Condition reclaimIdleCond; /* nothing pending any more */
+static cObjReclaim *reclaimHead=NULL, *reclaimTail=NULL;
+static long reclaimPending=0, reclaimDone=0;
+static enum {RECLAIM_IDLE, RECLAIM_RUNNING, RECLAIM_STOPPING, RECLAIM_NONE}
+	reclaimState=RECLAIM_IDLE;
+static Tcl_ThreadId reclaimThread;
+
+static Tcl_ThreadCreateType cObjReclaimThreadProc(ClientData data)
+{
+	cObjReclaim *item=NULL;
+	(void)data;
+	Tcl_MutexLock(&reclaimMutex);
+	while (1) {
+		while (reclaimHead==NULL && reclaimState==RECLAIM_RUNNING)
+			Tcl_ConditionWait(&reclaimWorkCond,&reclaimMutex,NULL);
+		if (reclaimHead==NULL) break; /* asked to stop, and drained */
+		item=reclaimHead;
+		reclaimHead=item->next;
+		if (reclaimHead==NULL) reclaimTail=NULL;
+		Tcl_MutexUnlock(&reclaimMutex);
+		item->deleteFunc(item->object);
+		ckfree((char*)item);
+		Tcl_MutexLock(&reclaimMutex);
+		reclaimPending--;
+		reclaimDone++;
+		if (reclaimPending==0) Tcl_ConditionNotify(&reclaimIdleCond);
+	}
+	Tcl_MutexUnlock(&reclaimMutex);
+	/* run the thread exit handlers the deleteFuncs may have set up */
+	Tcl_FinalizeThread();
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* let the thread finish what is queued, then join it */
+static void cObjReclaimExit(ClientData data)
+{
+	int result;
+	(void)data;
+	Tcl_MutexLock(&reclaimMutex);
+	reclaimState=RECLAIM_STOPPING;
+	Tcl_ConditionNotify(&reclaimWorkCond);
+	Tcl_MutexUnlock(&reclaimMutex);
+	Tcl_JoinThread(reclaimThread,&result);
+}
+
+static void cObjReclaimQueue(void (*deleteFunc)(void *ptr), void *object)
+{
+	cObjReclaim *item=NULL;
+	Tcl_MutexLock(&reclaimMutex);
+	if (reclaimState==RECLAIM_IDLE) {
+		if (Tcl_CreateThread(&reclaimThread,cObjReclaimThreadProc,NULL,
+					TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)==TCL_OK) {
+			reclaimState=RECLAIM_RUNNING;
+			Tcl_CreateExitHandler(cObjReclaimExit,NULL);
+		} else {
+			reclaimState=RECLAIM_NONE;
+		}
+	}
+	if (reclaimState!=RECLAIM_RUNNING) {
+		Tcl_MutexUnlock(&reclaimMutex);
+		deleteFunc(object);
+		return;
+	}
+	item=(cObjReclaim*)ckalloc(sizeof(cObjReclaim));
+	item->deleteFunc=deleteFunc;
+	item->object=object;
+	item->next=NULL;
+	if (reclaimTail!=NULL) reclaimTail->next=item;
+	else reclaimHead=item;
+	reclaimTail=item;
+	reclaimPending++;
+	Tcl_ConditionNotify(&reclaimWorkCond);
+	Tcl_MutexUnlock(&reclaimMutex);
+}
+
+void cObjReclaimFlush(void)
+{
+	Tcl_MutexLock(&reclaimMutex);
+	while (reclaimPending>0)
+		Tcl_ConditionWait(&reclaimIdleCond,&reclaimMutex,NULL);
+	Tcl_MutexUnlock(&reclaimMutex);
+}
+
+void cObjGetReclaimInfo(cObjReclaimInfo *infoPtr)
+{
+	Tcl_MutexLock(&reclaimMutex);
+	infoPtr->pending=reclaimPending;
+	infoPtr->done=reclaimDone;
+	Tcl_MutexUnlock(&reclaimMutex);
+}
+
+/* the instance command went away (e.g. it was renamed to {}); the
+ * object itself stays registered */
+static void cObjInstanceDeleted(ClientData data)
+{
+	((ObjCmdClientData*)data)->token=NULL;
+}
+
+/* The "cobjHandle" Tcl_ObjType caches the result of resolving an object
+ * name, so that repeated lookups through the same Tcl_Obj (typically a
+ * variable holding the handle, or a literal) skip the assoc data lookup
+ * and the name hash. The internal rep holds the state manager and the
+ * registry handle of the object; the handle's generation check fails
+ * as soon as the object is deleted, so stale handles fall back to the
+ * full lookup and are detected there. The state is kept alive with
+ * Tcl_Preserve() while cached.
+ * Handles of objects created with -autofree also hold a reference to the
+ * object, so the object lives exactly as long as some Tcl_Obj caches it.
+ * The serial of the state is kept too, since the handles of a state
+ * change meaning when it becomes a view of a shared registry.
+ * The reference goes with the rep, whether the Tcl_Obj is freed or
+ * converted to another type (e.g. by "llength $h"): Tcl can't tell
+ * us which. */
+typedef struct cObjHandleRep {
+	StateManager_t state;
+	VarHandle handle;
+	unsigned long serial;
+	cObj *owned; /* the object, if the rep holds a reference to it */
+} cObjHandleRep;
+
+static void cObjHandleFreeIntRep(Tcl_Obj *objPtr);
+static void cObjHandleDupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+static int  cObjHandleSetFromAny(Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+static Tcl_ObjType cObjHandleType = {
+	"cobjHandle",
+	cObjHandleFreeIntRep,
+	cObjHandleDupIntRep,
+	NULL, /* the string rep is never invalidated */
+	cObjHandleSetFromAny
+};
+
+#define HANDLE_REP(objPtr) ((cObjHandleRep*)(objPtr)->internalRep.twoPtrValue.ptr1)
+
+static void cObjHandleFreeIntRep(Tcl_Obj *objPtr)
+{
+	cObjHandleRep *rep=HANDLE_REP(objPtr);
+	objPtr->typePtr=NULL;
+	if (rep->owned!=NULL) cObjRelease(rep->owned);
+	Tcl_Release((ClientData)rep->state);
+	ckfree((char*)rep);
+}
+
+static void cObjHandleDupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr)
+{
+	cObjHandleRep *rep=(cObjHandleRep*)ckalloc(sizeof(cObjHandleRep));
+	*rep=*HANDLE_REP(srcPtr);
+	Tcl_Preserve((ClientData)rep->state);
+	if (rep->owned!=NULL) cObjRetain(rep->owned);
+	dupPtr->internalRep.twoPtrValue.ptr1=rep;
+	dupPtr->typePtr=&cObjHandleType;
+}
+
+/* The refcounts of the objects of a shared registry are updated
+ * atomically, as any thread may retain and release them. */
+#if !defined(__GNUC__)
+TCL_DECLARE_MUTEX(refcountMutex)
+#endif
+
+/* add delta to the refcount of a shared object, returning the new count */
+static uint64_t cObjSharedAdd(cObj *oPtr, int delta)
+{
+#if defined(__GNUC__)
+	return __atomic_add_fetch(&oPtr->refcount,(uint64_t)(int64_t)delta,
+			__ATOMIC_ACQ_REL);
+#else
+	uint64_t n;
+	Tcl_MutexLock(&refcountMutex);
+	n=(oPtr->refcount+=(uint64_t)(int64_t)delta);
+	Tcl_MutexUnlock(&refcountMutex);
+	return n;
+#endif
+}
+
+/* Add to the totals of a type, as its objects come and go. With a shared
+ * registry or a parallel teardown that happens on several threads. */
+#if !defined(__GNUC__)
+TCL_DECLARE_MUTEX(memoryMutex)
+#endif
+
+static void cObjTypeAccount(const cObjType *typePtr, long count, int64_t bytes)
+{
+	cObjType *t=(cObjType*)typePtr; /* only the totals change */
+#if defined(__GNUC__)
+	__atomic_add_fetch(&t->num_objects,count,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->num_bytes,(uint64_t)bytes,__ATOMIC_RELAXED);
+#else
+	Tcl_MutexLock(&memoryMutex);
+	t->num_objects+=count;
+	t->num_bytes+=(uint64_t)bytes;
+	Tcl_MutexUnlock(&memoryMutex);
+#endif
+}
+
+/* count a newly registered object in the totals of its type */
+static void cObjCount(cObj *oPtr)
+{
+	if (oPtr->type==NULL) return;
+	oPtr->flags|=COBJ_FLAG_COUNTED;
+	cObjTypeAccount(oPtr->type,1,(int64_t)oPtr->size);
+}
+
+/* take an object out of the totals once its name is gone: the type may
+ * go away before the object does */
+static void cObjUncount(cObj *oPtr)
+{
+	if (!(oPtr->flags & COBJ_FLAG_COUNTED)) return;
+	oPtr->flags&=~COBJ_FLAG_COUNTED;
+	cObjTypeAccount(oPtr->type,-1,-(int64_t)oPtr->size);
+}
+
+void cObjUpdateSize(cObj *oPtr)
+{
+	size_t size;
+	if (oPtr->type==NULL || oPtr->type->sizeFunc==NULL) return;
+	size=oPtr->type->sizeFunc(oPtr->object);
+	if (oPtr->flags & COBJ_FLAG_COUNTED)
+		cObjTypeAccount(oPtr->type,0,(int64_t)size-(int64_t)oPtr->size);
+	oPtr->size=size;
+}
+
+/* Take a reference, unless the object is already on its way out (its
+ * count dropped to 0). Returns 1 if the reference was taken. Used with
+ * varAcquireFromHandle(), so that a delete on another thread can't free
+ * the object in between finding and retaining it. */
+static int cObjTryRetain(ClientData data)
+{
+	cObj *oPtr=(cObj*)data;
+#if defined(__GNUC__)
+	uint64_t n;
+	if (oPtr->flags & COBJ_FLAG_SHARED) {
+		n=__atomic_load_n(&oPtr->refcount,__ATOMIC_RELAXED);
+		do {
+			if (n==0) return 0;
+		} while (!__atomic_compare_exchange_n(&oPtr->refcount,&n,n+1,1,
+					__ATOMIC_ACQ_REL,__ATOMIC_RELAXED));
+		return 1;
+	}
+#else
+	int taken=0;
+	if (oPtr->flags & COBJ_FLAG_SHARED) {
+		Tcl_MutexLock(&refcountMutex);
+		if (oPtr->refcount>0) {
+			oPtr->refcount++;
+			taken=1;
+		}
+		Tcl_MutexUnlock(&refcountMutex);
+		return taken;
+	}
+#endif
+	if (oPtr->refcount==0) return 0;
+	oPtr->refcount++;
+	return 1;
+}
+
+/* Count a reference taken by "retain" (delta 1), or give one back
+ * (delta -1) if there is any. Returns 1 unless there was nothing to give
+ * back. Atomic for shared objects, like the refcount. */
+static int cObjRetainedAdd(cObjBlock *block, int delta)
+{
+#if defined(__GNUC__)
+	uint64_t n;
+	if (block->obj.flags & COBJ_FLAG_SHARED) {
+		if (delta>0) {
+			__atomic_add_fetch(&block->retained,1,__ATOMIC_ACQ_REL);
+			return 1;
+		}
+		n=__atomic_load_n(&block->retained,__ATOMIC_RELAXED);
+		do {
+			if (n==0) return 0;
+		} while (!__atomic_compare_exchange_n(&block->retained,&n,n-1,1,
+					__ATOMIC_ACQ_REL,__ATOMIC_RELAXED));
+		return 1;
+	}
+#else
+	int done=1;
+	if (block->obj.flags & COBJ_FLAG_SHARED) {
+		Tcl_MutexLock(&refcountMutex);
+		if (delta>0) block->retained++;
+		else if (block->retained>0) block->retained--;
+		else done=0;
+		Tcl_MutexUnlock(&refcountMutex);
+		return done;
+	}
+#endif
+	if (delta>0) {
+		block->retained++;
+		return 1;
+	}
+	if (block->retained==0) return 0;
+	block->retained--;
+	return 1;
+}
+
+/* the handle of an autofree object holds a reference to it */
+static int cObjHandleAcquire(ClientData data)
+{
+	if (!(((cObj*)data)->flags & COBJ_FLAG_AUTOFREE)) return 1;
+	return cObjTryRetain(data);
+}
+
+/* replace the internal rep of objPtr with a cached handle for the
+ * variable of the same name */
+static void cObjHandleSet(Tcl_Obj *objPtr, StateManager_t statePtr, VarHandle handle)
+{
+	cObjHandleRep *rep=NULL;
+	cObj *oPtr=(cObj*)varAcquireFromHandle(statePtr,handle,cObjHandleAcquire);
+	cObj *owned=NULL;
+	if (oPtr!=NULL && (oPtr->flags & COBJ_FLAG_AUTOFREE)) owned=oPtr;
+	if (objPtr->typePtr==&cObjHandleType) {
+		rep=HANDLE_REP(objPtr);
+		if (rep->state!=statePtr) {
+			Tcl_Release((ClientData)rep->state);
+			Tcl_Preserve((ClientData)statePtr);
+		}
+		if (rep->owned!=NULL) cObjRelease(rep->owned);
+	} else {
+		/* make sure the string rep survives losing the old internal rep */
+		Tcl_GetString(objPtr);
+		if (objPtr->typePtr!=NULL && objPtr->typePtr->freeIntRepProc!=NULL)
+			objPtr->typePtr->freeIntRepProc(objPtr);
+		rep=(cObjHandleRep*)ckalloc(sizeof(cObjHandleRep));
+		Tcl_Preserve((ClientData)statePtr);
+		objPtr->internalRep.twoPtrValue.ptr1=rep;
+		objPtr->typePtr=&cObjHandleType;
+	}
+	rep->state=statePtr;
+	rep->handle=handle;
+	rep->serial=statePtr->serial;
+	rep->owned=owned;
+}
+
+/* Leave the error for a name that resolves to nothing. Generated names
+ * are never reused, so one of those names an object that is gone. */
+static void cObjUnknown(Tcl_Interp *interp, StateManager_t statePtr, Tcl_Obj *objPtr)
+{
+	const char *name=Tcl_GetString(objPtr);
+	size_t len=strlen(statePtr->prefix);
+	Tcl_AppendResult(interp,"Unknown var: ",name,NULL);
+	if (strncmp(name,statePtr->prefix,len)==0 && name[len]!='\0'
+			&& strspn(name+len,"0123456789")==strlen(name+len)) {
+		Tcl_AppendResult(interp," (deleted, or -autofree and no longer held"
+			" by a value used as its handle)",NULL);
+	}
+}
+
+static int cObjHandleSetFromAny(Tcl_Interp *interp, Tcl_Obj *objPtr)
+{
+	VarHandle handle;
+	StateManager_t statePtr=NULL;
+	if (interp==NULL) return TCL_ERROR;
+	statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	if (statePtr==NULL) {
+		Tcl_AppendResult(interp,"No state stored by key `",COBJSTATEKEY,"'\n",NULL);
+		return TCL_ERROR;
+	}
+	if (!varHandleFromName(statePtr,Tcl_GetString(objPtr),&handle)) {
+		cObjUnknown(interp,statePtr,objPtr);
+		return TCL_ERROR;
+	}
+	cObjHandleSet(objPtr,statePtr,handle);
+	return TCL_OK;
+}
+
+#define HANDLE_VALID(rep,interp) \
+	((rep)->state->interp==(interp) && (rep)->serial==(rep)->state->serial)
+
+/* Resolve a handle to its cObj, using the cached internal rep when it
+ * is still valid for this interpreter. acquireProc is as for
+ * varAcquireFromHandle(). */
+static int cObjResolveHandle(Tcl_Interp *interp, Tcl_Obj *CONST name,
+		varAcquireFunction acquireProc, cObj **iPtrPtr)
+{
+	cObjHandleRep *rep=NULL;
+	if (name->typePtr==&cObjHandleType) {
+		rep=HANDLE_REP(name);
+		if (HANDLE_VALID(rep,interp)) {
+			*iPtrPtr=(cObj*)varAcquireFromHandle(rep->state,rep->handle,acquireProc);
+			if (*iPtrPtr!=NULL) return TCL_OK;
+		}
+	}
+	if (cObjHandleSetFromAny(interp,name)!=TCL_OK) return TCL_ERROR;
+	rep=HANDLE_REP(name);
+	*iPtrPtr=(cObj*)varAcquireFromHandle(rep->state,rep->handle,acquireProc);
+	if (*iPtrPtr==NULL) {
+		/* deleted by another thread meanwhile */
+		cObjUnknown(interp,rep->state,name);
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+static int cObjFromHandle(Tcl_Interp *interp, Tcl_Obj *CONST name, cObj **iPtrPtr)
+{
+	return cObjResolveHandle(interp,name,NULL,iPtrPtr);
+}
+
+int cObjAcquire(Tcl_Interp *interp, Tcl_Obj *CONST name, cObj **iPtrPtr)
+{
+	return cObjResolveHandle(interp,name,cObjTryRetain,iPtrPtr);
+}
 
 int getcObjFromObj(Tcl_Interp *interp, Tcl_Obj *CONST name,
 						const char *type_name,
@@ -54,7 +632,7 @@ int getcObjFromObj(Tcl_Interp *interp, Tcl_Obj *CONST name,
 		Tcl_AppendResult(interp,"invalid type passed to ",__func__," \n",NULL);
 		return TCL_ERROR;
 	}
-	if (getVarFromObjKey(COBJSTATEKEY,interp,name,(void**)iPtrPtr)!=TCL_OK)
+	if (cObjFromHandle(interp,name,iPtrPtr)!=TCL_OK)
 		return TCL_ERROR;
 	obj=*iPtrPtr;
 	if (obj->type_hash != TYPEHASH(type_name,-1)) {
@@ -65,18 +643,94 @@ int getcObjFromObj(Tcl_Interp *interp, Tcl_Obj *CONST name,
 	return TCL_OK;
 }
 
+int getcObjFromObjType(Tcl_Interp *interp, Tcl_Obj *CONST name,
+		const cObjType *type, cObj **iPtrPtr)
+{
+	if (type==NULL) {
+		Tcl_AppendResult(interp,"invalid type passed to ",__func__," \n",NULL);
+		return TCL_ERROR;
+	}
+	if (cObjFromHandle(interp,name,iPtrPtr)!=TCL_OK)
+		return TCL_ERROR;
+	if ((*iPtrPtr)->type_hash != type->hash) {
+		Tcl_AppendResult(interp,"src object is not of type ",type->name,"\n", NULL);
+		*iPtrPtr=NULL;
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+int getcObjFromObjHash(Tcl_Interp *interp, Tcl_Obj *CONST name,
+		uint64_t type_hash, cObj **iPtrPtr)
+{
+	if (cObjFromHandle(interp,name,iPtrPtr)!=TCL_OK)
+		return TCL_ERROR;
+	if ((*iPtrPtr)->type_hash != type_hash) {
+		Tcl_AppendResult(interp,"src object is not of the requested type (it is a ",
+				(*iPtrPtr)->type_name,")\n", NULL);
+		*iPtrPtr=NULL;
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
 // The following creates and initialize an cObj objects
+/* type information for the state manager, e.g. for "cobj delete -type" */
+static uint64_t cObjTypeKey(ClientData element)
+{
+	return ((cObj*)element)->type_hash;
+}
+
+static uint64_t cObjTypeNameKey(const char *type_name)
+{
+	return TYPEHASH(type_name,-1);
+}
+
 int cObjState_Init(Tcl_Interp *interp)
 {
-	InitializeStateManager(interp,COBJSTATEKEY,"cobj",cObjCmd,cObjDelete);
+	StateManager_t statePtr=NULL;
+	struct cObjStateContext *ctx=NULL;
+	Tcl_RegisterObjType(&cObjHandleType);
+	if (InitializeStateManager(interp,COBJSTATEKEY,"cobj",cObjCmd,cObjDelete)!=TCL_OK)
+		return TCL_ERROR;
+	statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	if (statePtr->ext==NULL) {
+		ctx=(struct cObjStateContext*)ckalloc(sizeof(struct cObjStateContext));
+		memset(ctx,0,sizeof(struct cObjStateContext));
+		ctx->commands=1;
+		statePtr->ext=(ClientData)ctx;
+		statePtr->extFreeProc=cObjContextFree;
+		statePtr->typeKeyProc=cObjTypeKey;
+		statePtr->typeNameKeyProc=cObjTypeNameKey;
+		statePtr->teardownProc=cObjTeardown;
+		statePtr->deleteCheckProc=cObjDeleteCheck;
+		cObjPortAdd(interp);
+	}
 	return TCL_OK;
 }
 
 /* cObjCmd --
  * This implements the cObj command, which has these subcommands:
- *  create <type> 
+ *  create <type> ?-count n? ?-autofree? <args>
  *   where "type" must be the name of one of the registered object types,
  *   for example "cam", or "img", or perhaps "mycoolstruct"
+ *  invoke <handle> <subcommand> <args>
+ *   calls a subcommand of an object, as "$handle subcommand" would;
+ *   objects created with -autofree can only be reached this way
+ *  memory ?-type <type>?
+ *   returns the number and total size of the objects of a type, or of
+ *   all types, see cObjMemoryCmd()
+ *  configure ?option? ?value option value ...?
+ *   queries or changes the options of this interpreter's objects
+ *  stats
+ *   returns a dictionary describing the object pool and the background
+ *   reclamation of COBJ_TYPE_ASYNC_DELETE objects
+ *  flush
+ *   waits until all queued background reclamations have completed
+ *  foreach -type <type> ?-parallel? ?-threads n? <subcommand> <args>
+ *   calls a subcommand of every object of a type, see cObjForEachCmd()
+ *  transfer <handle> <interp or thread>
+ *   hands an object over to another interpreter, see cObjTransfer()
  *
  * Results:
  *  A standard Tcl command result.
@@ -86,10 +740,15 @@ int cObjCmd(ClientData data, Tcl_Interp *interp,
 {
 	// the subCmd array defines the allowed values for the subcommand.  
 	CONST char *subCmds[] = {
-		"create",NULL};
-	enum cObjIx { CreateIx };
+		"configure","create","flush","foreach","invoke","memory","stats",
+		"transfer",NULL};
+	enum cObjIx { ConfigureIx, CreateIx, FlushIx, ForEachIx, InvokeIx, MemoryIx,
+		StatsIx, TransferIx };
+	cObjPoolInfo info;
+	cObjReclaimInfo reclaimInfo;
+	Tcl_Obj *dictObj=NULL;
 
-	if (objc<3) {
+	if (objc<2) {
 		Tcl_WrongNumArgs(interp,1,objv,"[sub-command] [type] <args>");
 		return TCL_ERROR;
 	}
@@ -104,8 +763,59 @@ int cObjCmd(ClientData data, Tcl_Interp *interp,
 
 	switch (index) {
 		case CreateIx:
+			if (objc<3) {
+				Tcl_WrongNumArgs(interp,2,objv,"[type] <args>");
+				return TCL_ERROR;
+			}
 			return cObjCreate(data,interp,objc,objv);
 			break;
+		case ConfigureIx:
+			return cObjConfigure(data,interp,objc,objv);
+		case InvokeIx:
+			if (objc<4) {
+				Tcl_WrongNumArgs(interp,2,objv,"handle subcommand ?arg ...?");
+				return TCL_ERROR;
+			}
+			return cObjInvoke(data,interp,objc,objv);
+		case StatsIx:
+			if (objc!=2) {
+				Tcl_WrongNumArgs(interp,2,objv,NULL);
+				return TCL_ERROR;
+			}
+			if (cObjGetPoolInfo(interp,&info)!=TCL_OK) return TCL_ERROR;
+			dictObj=Tcl_NewDictObj();
+			Tcl_DictObjPut(NULL,dictObj,Tcl_NewStringObj("poolSlabs",-1),
+					Tcl_NewLongObj(info.slabs));
+			Tcl_DictObjPut(NULL,dictObj,Tcl_NewStringObj("poolBlocks",-1),
+					Tcl_NewLongObj(info.blocks));
+			Tcl_DictObjPut(NULL,dictObj,Tcl_NewStringObj("poolInUse",-1),
+					Tcl_NewLongObj(info.in_use));
+			Tcl_DictObjPut(NULL,dictObj,Tcl_NewStringObj("poolBlockSize",-1),
+					Tcl_NewLongObj((long)info.block_size));
+			cObjGetReclaimInfo(&reclaimInfo);
+			Tcl_DictObjPut(NULL,dictObj,Tcl_NewStringObj("reclaimPending",-1),
+					Tcl_NewLongObj(reclaimInfo.pending));
+			Tcl_DictObjPut(NULL,dictObj,Tcl_NewStringObj("reclaimDone",-1),
+					Tcl_NewLongObj(reclaimInfo.done));
+			Tcl_SetObjResult(interp,dictObj);
+			return TCL_OK;
+		case FlushIx:
+			if (objc!=2) {
+				Tcl_WrongNumArgs(interp,2,objv,NULL);
+				return TCL_ERROR;
+			}
+			cObjReclaimFlush();
+			return TCL_OK;
+		case ForEachIx:
+			return cObjForEachCmd(data,interp,objc,objv);
+		case MemoryIx:
+			return cObjMemoryCmd(data,interp,objc,objv);
+		case TransferIx:
+			if (objc!=4) {
+				Tcl_WrongNumArgs(interp,2,objv,"handle target");
+				return TCL_ERROR;
+			}
+			return cObjTransferCmd(data,interp,objc,objv);
 		default:
 			return TCL_ERROR;
 	}
@@ -117,124 +827,1587 @@ int registerNewType(Tcl_Interp *interp,
 		CreateObjFunc createObjFunc,
 		InstanceCommandFunc instanceCommand)
 {
-	if (type_name == NULL || createObjFunc == NULL || instanceCommand == NULL)
-	{
-		return TCL_ERROR;
-	}
+	return registerNewTypeEx(interp,type_name,createObjFunc,instanceCommand,NULL);
+}
 
-	StateManager_t statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
-	if (statePtr==NULL) {
-		Tcl_AppendResult(interp,"No state stored by key `",COBJSTATEKEY,"'\n",NULL);
-		return TCL_ERROR;
+/* find a registered type by exact name */
+static cObjType *cObjLookupType(StateManager_t statePtr, const char *type_name)
+{
+	Tcl_HashEntry *entryPtr=NULL;
+	cObjType *typePtr=NULL;
+	entryPtr=Tcl_FindHashEntry(&statePtr->type_table,
+			(char*)(uintptr_t)TYPEHASH(type_name,-1));
+	if (entryPtr==NULL) return NULL;
+	for (typePtr=(cObjType*)Tcl_GetHashValue(entryPtr);typePtr!=NULL;
+			typePtr=typePtr->next_same_hash) {
+		if (strcmp(typePtr->name,type_name)==0) return typePtr;
 	}
+	return NULL;
+}
 
-	if (statePtr->num_reg_types >= statePtr->max_num_reg_types) {
-		Tcl_AppendResult(interp,"No slots left to register new type `",
-				type_name,
-				"'\n",NULL);
-		return TCL_ERROR;
-	}
-	if (statePtr->num_reg_types==0) {
-		/* this is a way to ensure that reg_type_names is initialied */
-		int i;
-		for (i=0;i<statePtr->max_num_reg_types;i++) {
-			statePtr->reg_type_names[i]=NULL;
-			statePtr->reg_types_create_procs[i]=NULL;
-			statePtr->reg_types_instance_commands[i]=NULL;
+int registerNewTypeEx(Tcl_Interp *interp,
+		const char *type_name,
+		CreateObjFunc createObjFunc,
+		InstanceCommandFunc instanceCommand,
+		cObjType **typePtrPtr)
+{
+	if (instanceCommand == NULL) return TCL_ERROR;
+	return registerNewTypeMethods(interp,type_name,createObjFunc,NULL,
+			instanceCommand,typePtrPtr);
+}
+
+static int cObjMethodCompare(const void *a, const void *b)
+{
+	return strcmp(((const cObjMethod*)a)->name,((const cObjMethod*)b)->name);
+}
+
+TCL_DECLARE_MUTEX(typeSerialMutex)
+static unsigned long typeSerial=0;
+
+/* Build the descriptor of a type. The descriptor, its sorted method
+ * table and its copy of the name all share one block. Returns NULL,
+ * leaving an error in interp, if two methods have the same name. */
+static cObjType *cObjTypeNew(Tcl_Interp *interp, const char *type_name,
+		CreateObjFunc createObjFunc, const cObjMethod *methods, int nmethods,
+		InstanceCommandFunc instanceCommand)
+{
+	cObjType *typePtr=NULL;
+	cObjMethod *sorted=NULL;
+	size_t len;
+	int i;
+	len=strlen(type_name);
+	typePtr=(cObjType*)ckalloc(sizeof(cObjType)+nmethods*sizeof(cObjMethod)+len+1);
+	memset(typePtr,0,sizeof(cObjType));
+	sorted=(cObjMethod*)(typePtr+1);
+	memcpy(sorted+nmethods,type_name,len+1);
+	typePtr->name=(const char*)(sorted+nmethods);
+	typePtr->hash=TYPEHASH(type_name,-1);
+	typePtr->createProc=createObjFunc;
+	typePtr->instanceCommand=instanceCommand;
+	if (nmethods>0) {
+		memcpy(sorted,methods,nmethods*sizeof(cObjMethod));
+		qsort(sorted,nmethods,sizeof(cObjMethod),cObjMethodCompare);
+		for (i=1;i<nmethods;i++) {
+			if (strcmp(sorted[i-1].name,sorted[i].name)==0) {
+				Tcl_AppendResult(interp,"duplicate subcommand `",sorted[i].name,
+						"' for type `",type_name,"'\n",NULL);
+				ckfree((char*)typePtr);
+				return NULL;
+			}
 		}
-		statePtr->reg_type_names[statePtr->max_num_reg_types]=NULL;
+		typePtr->methods=sorted;
+		typePtr->num_methods=nmethods;
 	}
-	statePtr->reg_types_create_procs[statePtr->num_reg_types]=createObjFunc;
-	statePtr->reg_types_instance_commands[statePtr->num_reg_types]=instanceCommand;
-	statePtr->reg_type_names[statePtr->num_reg_types]=strdup(type_name);
-	statePtr->reg_type_names[statePtr->num_reg_types+1]=NULL;
-	statePtr->num_reg_types++;
-	return TCL_OK;
+	Tcl_MutexLock(&typeSerialMutex);
+	typePtr->serial=++typeSerial;
+	Tcl_MutexUnlock(&typeSerialMutex);
+	return typePtr;
 }
 
-/* cObjInstanceCmd --
- * This implements the command tied to each instance of a
- * cObj Object. It looks at the Object type and passes control to the
- * instance command of the appropriate type.
- *
- * Results:
- *  A standard Tcl command result.
- */
-int cObjInstanceCmd(ClientData data, Tcl_Interp *interp,
-		          int objc, Tcl_Obj *CONST objv[])
+/* whether two descriptors describe the same type, e.g. one registered by
+ * the same extension loaded into several interpreters */
+static int cObjTypeSame(const cObjType *a, const cObjType *b)
 {
-	if (data==NULL) return TCL_ERROR;
-	if (objc==1) return TCL_OK; // No arguments were passed
-	ObjCmdClientData *cdata=(ObjCmdClientData*)data;
-	CONST char *subCmds[] = {"type",NULL};
-	enum cmdIx {TypeIx};
-	int index;
-	if (Tcl_GetIndexFromObj(interp,objv[1],subCmds,"subcommand",0,&index)!=TCL_OK)
-	{
-		/* then we did not recognize the subcommand. Perhaps the
-		 * specific type commands will understand it? */
-		/* clear the error */
-		Tcl_ResetResult(interp);
-		// Hand control to object-specfic instance command
-		return (*cdata->instanceCommand)(data,interp,objc,objv);
+	int i;
+	if (a->createProc!=b->createProc || a->instanceCommand!=b->instanceCommand
+			|| a->num_methods!=b->num_methods) return 0;
+	for (i=0;i<a->num_methods;i++) {
+		if (a->methods[i].proc!=b->methods[i].proc
+				|| strcmp(a->methods[i].name,b->methods[i].name)!=0) return 0;
 	}
+	return 1;
+}
 
-	// Are we asked to report object type?
-	switch(index) {
-		case TypeIx:
-			Tcl_AppendResult(interp,cdata->mSelf->type_name,NULL);
-			return TCL_OK;
+/* Add a new descriptor to the types of a state, which takes it over.
+ * Registering the very same type again is harmless: the new descriptor
+ * is freed, and the one already registered is returned in *typePtrPtr.
+ * For a shared registry the caller holds varLock(). */
+static int cObjTypeAdd(Tcl_Interp *interp, StateManager_t statePtr,
+		cObjType *typePtr, cObjType **typePtrPtr)
+{
+	cObjType *oldPtr=NULL;
+	Tcl_HashEntry *entryPtr=NULL;
+	int isNew;
+	oldPtr=cObjLookupType(statePtr,typePtr->name);
+	if (oldPtr!=NULL) {
+		isNew=cObjTypeSame(oldPtr,typePtr);
+		ckfree((char*)typePtr);
+		if (!isNew) {
+			Tcl_AppendResult(interp,"Type `",oldPtr->name,"' is already registered\n",NULL);
+			return TCL_ERROR;
+		}
+		if (typePtrPtr!=NULL) *typePtrPtr=oldPtr;
+		return TCL_OK;
 	}
+	if (statePtr->num_reg_types==statePtr->max_num_reg_types) {
+		statePtr->max_num_reg_types=statePtr->max_num_reg_types
+			? 2*statePtr->max_num_reg_types : 16;
+		statePtr->reg_types=(cObjType**)ckrealloc((char*)statePtr->reg_types,
+				statePtr->max_num_reg_types*sizeof(cObjType*));
+	}
+	statePtr->reg_types[statePtr->num_reg_types++]=typePtr;
+	entryPtr=Tcl_CreateHashEntry(&statePtr->type_table,
+			(char*)(uintptr_t)typePtr->hash,&isNew);
+	if (!isNew) typePtr->next_same_hash=(cObjType*)Tcl_GetHashValue(entryPtr);
+	Tcl_SetHashValue(entryPtr,(ClientData)typePtr);
+	if (typePtrPtr!=NULL) *typePtrPtr=typePtr;
 	return TCL_OK;
 }
 
-// The following routine actually creates cObj Objects 
-int cObjCreate(ClientData data, Tcl_Interp *interp,
-		int objc, Tcl_Obj *CONST objv[])
+int registerNewTypeMethods(Tcl_Interp *interp,
+		const char *type_name,
+		CreateObjFunc createObjFunc,
+		const cObjMethod *methods,
+		InstanceCommandFunc instanceCommand,
+		cObjType **typePtrPtr)
 {
-	StateManager_t statePtr=(StateManager_t)data;
-	cObj *oPtr;
-	ObjCmdClientData *cdata=NULL;
-	char *name_ptr=NULL;
-	char name[20];
-
-	// Get a variable name
-	if (varUniqName(interp,statePtr,name)!=TCL_OK) return TCL_ERROR;
-	name_ptr=name;
-
-	// Ceate object of the specified type
-	int index;
-	if (Tcl_GetIndexFromObj(interp,objv[2],statePtr->reg_type_names,"type",0,&index)!=TCL_OK)
+	cObjType *typePtr=NULL;
+	int nmethods=0, result;
+	if (type_name == NULL || createObjFunc == NULL
+			|| (instanceCommand == NULL && methods == NULL))
+	{
 		return TCL_ERROR;
-	oPtr=(cObj*)ckalloc(sizeof(cObj));
-	memset(oPtr,0,sizeof(cObj));
-	if (statePtr->reg_types_create_procs[index](data,interp,objc,objv,oPtr)!=TCL_OK) {
-		ckfree(oPtr);
+	}
+
+	StateManager_t statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	if (statePtr==NULL) {
+		Tcl_AppendResult(interp,"No state stored by key `",COBJSTATEKEY,"'\n",NULL);
 		return TCL_ERROR;
 	}
-	// Register it
-	registerVar(interp,statePtr,(ClientData)oPtr,name_ptr,REG_VAR_DELETE_OLD);
-	// make a command with the same name as this object 
-	cdata=(ObjCmdClientData*)ckalloc(sizeof(ObjCmdClientData));
-	memset(cdata,0,sizeof(ObjCmdClientData));
-	cdata->state=statePtr;
-	cdata->mSelf=oPtr;
-	cdata->instanceCommand=statePtr->reg_types_instance_commands[index];
-	Tcl_CreateObjCommand(interp,name_ptr,cObjInstanceCmd,(ClientData)cdata,NULL);
 
-	Tcl_AppendResult(interp,name_ptr,NULL);
-	return TCL_OK;
+	if (methods!=NULL) {
+		while (methods[nmethods].name!=NULL) {
+			if (methods[nmethods].proc==NULL) {
+				Tcl_AppendResult(interp,"no handler for subcommand `",
+						methods[nmethods].name,"' of type `",type_name,"'\n",NULL);
+				return TCL_ERROR;
+			}
+			nmethods++;
+		}
+	}
+	typePtr=cObjTypeNew(interp,type_name,createObjFunc,methods,nmethods,
+			instanceCommand);
+	if (typePtr==NULL) return TCL_ERROR;
+	/* the types of a shared registry are kept in its root */
+	varLock(statePtr);
+	result=cObjTypeAdd(interp,statePtr->root,typePtr,typePtrPtr);
+	varUnlock(statePtr);
+	return result;
 }
 
-void cObjDelete(void *ptr)
+int cObjState_Share(Tcl_Interp *interp)
 {
-	cObj *oPtr=(cObj *)ptr;
+	StateManager_t statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	StateManager_t root=NULL;
+	struct cObjStateContext *ctx=NULL;
+	cObjType *typePtr=NULL, *copy=NULL;
+	int i, result=TCL_OK;
+	if (statePtr==NULL || statePtr->ext==NULL) {
+		Tcl_AppendResult(interp,"No state stored by key `",COBJSTATEKEY,"'\n",NULL);
+		return TCL_ERROR;
+	}
+	if (statePtr->shared!=NULL) return TCL_OK;
+	if (varAttachShared(interp,statePtr)!=TCL_OK) return TCL_ERROR;
+	CONTEXT(statePtr)->commands=0;
+	root=statePtr->root;
+	varLock(statePtr);
+	if (root->ext==NULL) {
+		/* the registry lives as long as the process, and so does its pool */
+		ctx=(struct cObjStateContext*)ckalloc(sizeof(struct cObjStateContext));
+		memset(ctx,0,sizeof(struct cObjStateContext));
+		ctx->shared=1;
+		root->ext=(ClientData)ctx;
+	}
+	/* the types registered so far are copied, as the descriptors of the
+	 * interpreter go away with it */
+	for (i=0;i<statePtr->num_reg_types && result==TCL_OK;i++) {
+		typePtr=statePtr->reg_types[i];
+		copy=cObjTypeNew(interp,typePtr->name,typePtr->createProc,
+				typePtr->methods,typePtr->num_methods,typePtr->instanceCommand);
+		copy->flags=typePtr->flags;
+		copy->sizeFunc=typePtr->sizeFunc;
+		result=cObjTypeAdd(interp,root,copy,NULL);
+	}
+	varUnlock(statePtr);
+	return result;
+}
+
+int cObjGetType(Tcl_Interp *interp, const char *type_name,
+		cObjType **typePtrPtr)
+{
+	StateManager_t statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	if (statePtr==NULL) {
+		Tcl_AppendResult(interp,"No state stored by key `",COBJSTATEKEY,"'\n",NULL);
+		return TCL_ERROR;
+	}
+	if (type_name==NULL) return TCL_ERROR;
+	varLock(statePtr);
+	*typePtrPtr=cObjLookupType(statePtr->root,type_name);
+	varUnlock(statePtr);
+	if (*typePtrPtr==NULL) {
+		Tcl_AppendResult(interp,"Unknown type `",type_name,"'\n",NULL);
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+/* the totals of one type, read while they may change on other threads */
+static void cObjTypeTotals(const cObjType *typePtr, cObjMemoryInfo *infoPtr)
+{
+#if defined(__GNUC__)
+	infoPtr->objects=__atomic_load_n(&typePtr->num_objects,__ATOMIC_RELAXED);
+	infoPtr->bytes=__atomic_load_n(&typePtr->num_bytes,__ATOMIC_RELAXED);
+#else
+	Tcl_MutexLock(&memoryMutex);
+	infoPtr->objects=typePtr->num_objects;
+	infoPtr->bytes=typePtr->num_bytes;
+	Tcl_MutexUnlock(&memoryMutex);
+#endif
+}
+
+int cObjGetMemoryInfo(Tcl_Interp *interp, const char *type_name,
+		cObjMemoryInfo *infoPtr)
+{
+	StateManager_t statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	cObjMemoryInfo one;
+	cObjType *typePtr=NULL;
+	int i;
+	if (statePtr==NULL) {
+		Tcl_AppendResult(interp,"No state stored by key `",COBJSTATEKEY,"'\n",NULL);
+		return TCL_ERROR;
+	}
+	infoPtr->objects=0;
+	infoPtr->bytes=0;
+	if (type_name!=NULL) {
+		if (cObjGetType(interp,type_name,&typePtr)!=TCL_OK) return TCL_ERROR;
+		cObjTypeTotals(typePtr,infoPtr);
+		return TCL_OK;
+	}
+	varLock(statePtr);
+	for (i=0;i<statePtr->root->num_reg_types;i++) {
+		cObjTypeTotals(statePtr->root->reg_types[i],&one);
+		infoPtr->objects+=one.objects;
+		infoPtr->bytes+=one.bytes;
+	}
+	varUnlock(statePtr);
+	return TCL_OK;
+}
+
+/* The "cobjType" Tcl_ObjType caches the descriptor a type name resolved
+ * to, along with the serial of the state it was registered with. Types
+ * live as long as their state, so the descriptor is valid whenever that
+ * serial matches the state doing the lookup. */
+static Tcl_ObjType cObjTypeNameType = {
+	"cobjType",
+	NULL,
+	NULL, /* copied bitwise */
+	NULL, /* the string rep is never invalidated */
+	NULL
+};
+
+/* Resolve the type named by objPtr, as for "cobj create". Unique
+ * abbreviations of a type name are accepted, as they were when the
+ * names were matched with Tcl_GetIndexFromObj(), but not cached: a type
+ * registered later may make them ambiguous. */
+static int cObjTypeFromObj(Tcl_Interp *interp, StateManager_t viewPtr,
+		Tcl_Obj *objPtr, cObjType **typePtrPtr)
+{
+	StateManager_t statePtr=viewPtr->root; /* where the types are */
+	cObjType *typePtr=NULL;
+	const char *str=NULL;
+	int i, len, exact;
+	if (objPtr->typePtr==&cObjTypeNameType
+			&& (unsigned long)(uintptr_t)objPtr->internalRep.twoPtrValue.ptr2
+				==statePtr->serial) {
+		*typePtrPtr=(cObjType*)objPtr->internalRep.twoPtrValue.ptr1;
+		return TCL_OK;
+	}
+	varLock(viewPtr);
+	str=Tcl_GetStringFromObj(objPtr,&len);
+	typePtr=cObjLookupType(statePtr,str);
+	exact=(typePtr!=NULL);
+	if (typePtr==NULL && len>0) {
+		for (i=0;i<statePtr->num_reg_types;i++) {
+			if (strncmp(statePtr->reg_types[i]->name,str,len)!=0) continue;
+			if (typePtr!=NULL) {
+				typePtr=NULL; /* ambiguous */
+				break;
+			}
+			typePtr=statePtr->reg_types[i];
+		}
+	}
+	if (typePtr==NULL) {
+		Tcl_AppendResult(interp,"bad type \"",str,"\": ",NULL);
+		if (statePtr->num_reg_types==0)
+			Tcl_AppendResult(interp,"no types are registered",NULL);
+		for (i=0;i<statePtr->num_reg_types;i++) {
+			Tcl_AppendResult(interp,
+					(i==0) ? "must be "
+					: (i<statePtr->num_reg_types-1) ? ", "
+					: (i==1) ? " or " : ", or ",
+					statePtr->reg_types[i]->name,NULL);
+		}
+		varUnlock(viewPtr);
+		return TCL_ERROR;
+	}
+	varUnlock(viewPtr);
+	*typePtrPtr=typePtr;
+	if (!exact) return TCL_OK;
+	if (objPtr->typePtr!=&cObjTypeNameType) {
+		if (objPtr->typePtr!=NULL && objPtr->typePtr->freeIntRepProc!=NULL)
+			objPtr->typePtr->freeIntRepProc(objPtr);
+		objPtr->typePtr=&cObjTypeNameType;
+	}
+	objPtr->internalRep.twoPtrValue.ptr1=typePtr;
+	objPtr->internalRep.twoPtrValue.ptr2=(void*)(uintptr_t)statePtr->serial;
+	return TCL_OK;
+}
+
+/* cObjMemoryCmd --
+ * Implements "cobj memory ?-type type?". With a type, the result is a
+ * dictionary with the number of registered objects of the type and the
+ * bytes their sizeFuncs reported. Without, it holds the same totals over
+ * all types, and under "types" those of each type by name.
+ *
+ * Results:
+ *  A standard Tcl command result.
+ */
+int cObjMemoryCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	StateManager_t statePtr=(StateManager_t)data;
+	cObjMemoryInfo info, one;
+	cObjType *typePtr=NULL;
+	Tcl_Obj *dictObj=NULL, *typesObj=NULL, *typeObj=NULL;
+	int i;
+
+	if (objc==4 && strcmp(Tcl_GetString(objv[2]),"-type")==0) {
+		if (cObjTypeFromObj(interp,statePtr,objv[3],&typePtr)!=TCL_OK)
+			return TCL_ERROR;
+		cObjTypeTotals(typePtr,&info);
+	} else if (objc==2) {
+		info.objects=0;
+		info.bytes=0;
+		typesObj=Tcl_NewDictObj();
+		varLock(statePtr);
+		for (i=0;i<statePtr->root->num_reg_types;i++) {
+			typePtr=statePtr->root->reg_types[i];
+			cObjTypeTotals(typePtr,&one);
+			info.objects+=one.objects;
+			info.bytes+=one.bytes;
+			typeObj=Tcl_NewDictObj();
+			Tcl_DictObjPut(NULL,typeObj,Tcl_NewStringObj("objects",-1),
+					Tcl_NewLongObj(one.objects));
+			Tcl_DictObjPut(NULL,typeObj,Tcl_NewStringObj("bytes",-1),
+					Tcl_NewWideIntObj((Tcl_WideInt)one.bytes));
+			Tcl_DictObjPut(NULL,typesObj,Tcl_NewStringObj(typePtr->name,-1),typeObj);
+		}
+		varUnlock(statePtr);
+	} else {
+		Tcl_WrongNumArgs(interp,2,objv,"?-type type?");
+		return TCL_ERROR;
+	}
+	dictObj=Tcl_NewDictObj();
+	Tcl_DictObjPut(NULL,dictObj,Tcl_NewStringObj("objects",-1),
+			Tcl_NewLongObj(info.objects));
+	Tcl_DictObjPut(NULL,dictObj,Tcl_NewStringObj("bytes",-1),
+			Tcl_NewWideIntObj((Tcl_WideInt)info.bytes));
+	if (typesObj!=NULL)
+		Tcl_DictObjPut(NULL,dictObj,Tcl_NewStringObj("types",-1),typesObj);
+	Tcl_SetObjResult(interp,dictObj);
+	return TCL_OK;
+}
+
+/* Subcommands implemented by cObjInstanceCmd for objects of every type,
+ * unless the type's own table has them. Anything else is handed to the
+ * instance command of the object's type. */
+static CONST char *builtinSubCmds[] = {"release","retain","type",NULL};
+enum builtinIx {ReleaseIx, RetainIx, TypeIx};
+
+/* Match a subcommand against the builtins. "type" accepts abbreviations
+ * as it did when it was matched with Tcl_GetIndexFromObj(); release and
+ * retain must be spelled out, so that the instance command of a type
+ * still gets its own subcommands starting with "re". Unlike
+ * Tcl_GetIndexFromObj(), a miss costs a few byte compares and no error
+ * message, which matters since a miss is the common case. Returns the
+ * index, or -1. */
+static int cObjBuiltinIndex(Tcl_Obj *objPtr)
+{
+	int len, i;
+	const char *str=Tcl_GetStringFromObj(objPtr,&len);
+	if (len==0) return -1;
+	for (i=0;builtinSubCmds[i]!=NULL;i++) {
+		if (builtinSubCmds[i][0]!=str[0]
+				|| strncmp(builtinSubCmds[i],str,len)!=0) continue;
+		if (builtinSubCmds[i][len]=='\0' || i==TypeIx) return i;
+	}
+	return -1;
+}
+
+/* The "cobjMethod" Tcl_ObjType caches the subcommand table entry a
+ * subcommand resolved to, keyed by the serial of the type whose table was
+ * searched. The rep holds no references, so it needs no free proc. */
+static Tcl_ObjType cObjMethodType = {
+	"cobjMethod",
+	NULL,
+	NULL, /* copied bitwise */
+	NULL, /* the string rep is never invalidated */
+	NULL
+};
+
+#define METHOD_SERIAL(objPtr) ((unsigned long)(uintptr_t)(objPtr)->internalRep.twoPtrValue.ptr1)
+#define METHOD_INDEX(objPtr) ((int)(intptr_t)(objPtr)->internalRep.twoPtrValue.ptr2)
+
+/* Binary search the sorted table of a type, accepting unique
+ * abbreviations. Returns the index of the method, or -1. */
+static int cObjMethodIndex(const cObjType *typePtr, Tcl_Obj *objPtr)
+{
+	int len, lo=0, hi=typePtr->num_methods, mid;
+	const char *str=Tcl_GetStringFromObj(objPtr,&len);
+	const cObjMethod *m=typePtr->methods;
+	if (len==0) return -1;
+	while (lo<hi) {
+		mid=(lo+hi)/2;
+		if (strcmp(m[mid].name,str)<0) lo=mid+1;
+		else hi=mid;
+	}
+	if (lo==typePtr->num_methods || strncmp(m[lo].name,str,len)!=0) return -1;
+	if (m[lo].name[len]=='\0') return lo;
+	if (lo+1<typePtr->num_methods && strncmp(m[lo+1].name,str,len)==0) return -1;
+	return lo;
+}
+
+static void cObjMethodCache(Tcl_Obj *objPtr, const cObjType *typePtr, int index)
+{
+	if (objPtr->typePtr!=&cObjMethodType) {
+		Tcl_GetString(objPtr);
+		if (objPtr->typePtr!=NULL && objPtr->typePtr->freeIntRepProc!=NULL)
+			objPtr->typePtr->freeIntRepProc(objPtr);
+		objPtr->typePtr=&cObjMethodType;
+	}
+	objPtr->internalRep.twoPtrValue.ptr1=(void*)(uintptr_t)typePtr->serial;
+	objPtr->internalRep.twoPtrValue.ptr2=(void*)(intptr_t)index;
+}
+
+static int cObjMethodError(Tcl_Interp *interp, const cObjType *typePtr,
+		Tcl_Obj *objPtr)
+{
+	int i;
+	Tcl_AppendResult(interp,"bad subcommand \"",Tcl_GetString(objPtr),
+			"\": must be ",builtinSubCmds[0],NULL);
+	for (i=1;builtinSubCmds[i]!=NULL;i++)
+		Tcl_AppendResult(interp,", ",builtinSubCmds[i],NULL);
+	for (i=0;i<typePtr->num_methods;i++) {
+		Tcl_AppendResult(interp,
+				(i==typePtr->num_methods-1) ? ", or " : ", ",
+				typePtr->methods[i].name,NULL);
+	}
+	return TCL_ERROR;
+}
+
+/* cObjInstanceCall --
+ * The body of cObjInstanceCmd(), for callers that hold references of
+ * their own to the object while the subcommand runs ("cobj invoke" and
+ * "cobj foreach"): held of them are left out of the counts returned.
+ * "release" only gives back what "retain" took, so it can't drop the
+ * reference of the object's name or of its callers.
+ *
+ * Results:
+ *  A standard Tcl command result.
+ */
+static int cObjInstanceCall(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[], int held)
+{
+	const cObjType *typePtr=NULL;
+	int index;
+	if (data==NULL) return TCL_ERROR;
+	if (objc==1) return TCL_OK; // No arguments were passed
+	ObjCmdClientData *cdata=(ObjCmdClientData*)data;
+
+	// Subcommand already resolved against this type's table?
+	typePtr=cdata->mSelf->type;
+	if (typePtr!=NULL && objv[1]->typePtr==&cObjMethodType
+			&& METHOD_SERIAL(objv[1])==typePtr->serial) {
+		return typePtr->methods[METHOD_INDEX(objv[1])].proc(data,interp,objc,objv);
+	}
+
+	// the type's own methods come first, so that no builtin hides them
+	if (typePtr!=NULL && typePtr->num_methods>0) {
+		index=cObjMethodIndex(typePtr,objv[1]);
+		if (index>=0) {
+			cObjMethodCache(objv[1],typePtr,index);
+			return typePtr->methods[index].proc(data,interp,objc,objv);
+		}
+	}
+
+	switch(cObjBuiltinIndex(objv[1])) {
+		// Are we asked to report object type?
+		case TypeIx:
+			Tcl_AppendResult(interp,cdata->mSelf->type_name,NULL);
+			return TCL_OK;
+		// Take or drop a reference, returning the new count
+		case RetainIx:
+			cObjRetain(cdata->mSelf);
+			cObjRetainedAdd((cObjBlock*)cdata->mSelf,1);
+			Tcl_SetObjResult(interp,
+					Tcl_NewWideIntObj((Tcl_WideInt)cdata->mSelf->refcount-held));
+			return TCL_OK;
+		case ReleaseIx:
+			// the name holds a reference of its own, dropped by "cobj delete"
+			if (!cObjRetainedAdd((cObjBlock*)cdata->mSelf,-1)) {
+				Tcl_AppendResult(interp,"no reference to release, use \"cobj delete ",
+						Tcl_GetString(objv[0]),"\" instead",NULL);
+				return TCL_ERROR;
+			}
+			cObjRelease(cdata->mSelf);
+			Tcl_SetObjResult(interp,
+					Tcl_NewWideIntObj((Tcl_WideInt)cdata->mSelf->refcount-held));
+			return TCL_OK;
+	}
+
+	if (typePtr!=NULL && typePtr->num_methods>0 && cdata->instanceCommand==NULL)
+		return cObjMethodError(interp,typePtr,objv[1]);
+	// Hand control to object-specfic instance command
+	return (*cdata->instanceCommand)(data,interp,objc,objv);
+}
+
+/* cObjInstanceCmd --
+ * This implements the command tied to each instance of a
+ * cObj Object. It looks at the Object type and passes control to the
+ * instance command of the appropriate type.
+ *
+ * Results:
+ *  A standard Tcl command result.
+ */
+int cObjInstanceCmd(ClientData data, Tcl_Interp *interp,
+		          int objc, Tcl_Obj *CONST objv[])
+{
+	return cObjInstanceCall(data,interp,objc,objv,0);
+}
+
+/* Create one object of a resolved type, register it and give it its
+ * instance command. objc/objv are handed to the type's create proc
+ * unchanged. With COBJ_FLAG_AUTOFREE in flags, the returned handle holds
+ * the only reference and no instance command is made, since resolving a
+ * command name would throw away the handle's internal rep. The handle is returned in *handleObjPtr holding a
+ * reference that the caller must release. */
+static int cObjCreateOne(StateManager_t statePtr, Tcl_Interp *interp,
+		cObjType *typePtr, int flags, int objc, Tcl_Obj *CONST objv[],
+		Tcl_Obj **handleObjPtr)
+{
+	cObj *oPtr;
+	cObjBlock *block=NULL;
+	ObjCmdClientData *cdata=NULL;
+	Tcl_Obj *handleObj=NULL;
+	VarHandle handle;
+	char *name_ptr=NULL;
+
+	// Get a variable name
+	if (varUniqNameObj(interp,statePtr,&handleObj)!=TCL_OK) return TCL_ERROR;
+	Tcl_IncrRefCount(handleObj);
+	name_ptr=Tcl_GetString(handleObj);
+
+	block=cObjBlockAlloc(POOL(statePtr));
+	oPtr=&block->obj;
+	oPtr->type=typePtr;
+	oPtr->flags|=flags & COBJ_FLAG_AUTOFREE;
+	if (statePtr->shared!=NULL) oPtr->flags|=COBJ_FLAG_SHARED;
+	// descriptors go away with the state, objects may outlive it
+	if (typePtr->flags & COBJ_TYPE_ASYNC_DELETE) oPtr->flags|=COBJ_FLAG_ASYNC_DELETE;
+	// the registry's reference; autofree objects get theirs from the
+	// handle, this one is handed over to it below
+	oPtr->refcount=1;
+	if (typePtr->createProc((ClientData)statePtr,interp,objc,objv,oPtr)!=TCL_OK) {
+		cObjBlockFree(block);
+		Tcl_DecrRefCount(handleObj);
+		return TCL_ERROR;
+	}
+	// fill in the type identification if the create proc did not
+	if (oPtr->type_hash==0) {
+		strncpy(oPtr->type_name,oPtr->type->name,sizeof(oPtr->type_name)-1);
+		oPtr->type_hash=oPtr->type->hash;
+	}
+	if (typePtr->sizeFunc!=NULL) oPtr->size=typePtr->sizeFunc(oPtr->object);
+	cObjCount(oPtr);
+	// Register it
+	registerVar(interp,statePtr,(ClientData)oPtr,name_ptr,REG_VAR_DELETE_OLD);
+	varHandleFromName(statePtr,name_ptr,&handle);
+	block->handle=handle;
+	// make a command with the same name as this object 
+	cdata=&block->cdata;
+	cdata->state=statePtr->root; // outlives the interpreter if shared
+	cdata->mSelf=oPtr;
+	cdata->instanceCommand=typePtr->instanceCommand;
+	if (!(flags & COBJ_FLAG_AUTOFREE) && CONTEXT(statePtr)->commands) {
+		cdata->token=Tcl_CreateObjCommand(interp,name_ptr,cObjInstanceCmd,
+				(ClientData)cdata,cObjInstanceDeleted);
+	}
+
+	// return a handle that already caches the new object
+	cObjHandleSet(handleObj,statePtr,handle);
+	if (flags & COBJ_FLAG_AUTOFREE) cObjRelease(oPtr);
+	*handleObjPtr=handleObj;
+	return TCL_OK;
+}
+
+int cObjCreateMany(Tcl_Interp *interp, cObjType *typePtr, int count,
+		int flags, int objc, Tcl_Obj *CONST objv[], Tcl_Obj **listPtr)
+{
+	StateManager_t statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	struct cObjStateContext *ctx=NULL;
+	Tcl_Obj *listObj=NULL, *handleObj=NULL, **elems=NULL;
+	int i, n;
+	if (statePtr==NULL || statePtr->ext==NULL) {
+		Tcl_AppendResult(interp,"No state stored by key `",COBJSTATEKEY,"'\n",NULL);
+		return TCL_ERROR;
+	}
+	if (typePtr==NULL || count<0) {
+		Tcl_AppendResult(interp,"invalid arguments passed to ",__func__,"\n",NULL);
+		return TCL_ERROR;
+	}
+	// size the registry and the pool for all of them up front
+	ctx=POOL(statePtr);
+	varReserve(statePtr,count);
+	cObjPoolReserve(ctx,count);
+
+	listObj=Tcl_NewListObj(count,NULL);
+	Tcl_IncrRefCount(listObj);
+	for (i=0;i<count;i++) {
+		if (cObjCreateOne(statePtr,interp,typePtr,flags,objc,objv,&handleObj)!=TCL_OK) {
+			// don't leave half a batch behind
+			Tcl_ListObjGetElements(NULL,listObj,&n,&elems);
+			for (i=0;i<n;i++) varDelete0(interp,statePtr,elems[i]);
+			Tcl_DecrRefCount(listObj);
+			return TCL_ERROR;
+		}
+		Tcl_ListObjAppendElement(NULL,listObj,handleObj);
+		Tcl_DecrRefCount(handleObj);
+	}
+	*listPtr=listObj;
+	return TCL_OK;
+}
+
+/* cObjCreate --
+ * Implements "cobj create <type> ?-count n? ?-autofree? ?args ...?".
+ * With -count, n objects are created in one go and their handles returned
+ * as a list. With -autofree, an object is freed as soon as no Tcl value
+ * holding its handle is left, instead of by "cobj delete"; such objects
+ * have no command and are used through "cobj invoke". A value that is
+ * used as something else (e.g. "llength $h") stops holding the object,
+ * and the name is unknown from then on unless another value still holds
+ * it or the object was retained. The create proc of
+ * the type sees the same arguments either way, i.e. without the options.
+ */
+int cObjCreate(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	StateManager_t statePtr=(StateManager_t)data;
+	cObjType *typePtr=NULL;
+	Tcl_Obj *resultObj=NULL;
+	Tcl_Obj **argv=NULL;
+	int count=-1, flags=0, i=3, result;
+	const char *opt=NULL;
+
+	if (cObjTypeFromObj(interp,statePtr,objv[2],&typePtr)!=TCL_OK)
+		return TCL_ERROR;
+	for (i=3;i<objc;i++) {
+		opt=Tcl_GetString(objv[i]);
+		if (strcmp(opt,"-autofree")==0) {
+			flags|=COBJ_FLAG_AUTOFREE;
+		} else if (strcmp(opt,"-count")==0) {
+			if (i+1==objc) {
+				Tcl_WrongNumArgs(interp,3,objv,"-count n ?args ...?");
+				return TCL_ERROR;
+			}
+			if (Tcl_GetIntFromObj(interp,objv[++i],&count)!=TCL_OK) return TCL_ERROR;
+			if (count<0) {
+				Tcl_AppendResult(interp,"count must be non-negative",NULL);
+				return TCL_ERROR;
+			}
+		} else {
+			break;
+		}
+	}
+	// strip the options from what the create proc gets to see
+	if (i>3) {
+		argv=(Tcl_Obj**)ckalloc((objc-i+3)*sizeof(Tcl_Obj*));
+		memcpy(argv,objv,3*sizeof(Tcl_Obj*));
+		memcpy(argv+3,objv+i,(objc-i)*sizeof(Tcl_Obj*));
+		objv=argv;
+		objc=objc-i+3;
+	}
+	if (count<0) {
+		result=cObjCreateOne(statePtr,interp,typePtr,flags,objc,objv,&resultObj);
+	} else {
+		result=cObjCreateMany(interp,typePtr,count,flags,objc,objv,&resultObj);
+	}
+	if (argv!=NULL) ckfree((char*)argv);
+	if (result!=TCL_OK) return TCL_ERROR;
+	Tcl_SetObjResult(interp,resultObj);
+	Tcl_DecrRefCount(resultObj);
+	return TCL_OK;
+}
+
+/* cObjInvoke --
+ * Implements "cobj invoke <handle> <subcommand> ?args ...?", dispatching
+ * exactly like the instance command of the object would. The object is
+ * retained for the duration of the call, as the handle's internal rep
+ * could be lost meanwhile, or another thread delete it. The subcommand
+ * sees the state of the invoking interpreter, even for objects of a
+ * shared registry.
+ *
+ * Results:
+ *  A standard Tcl command result.
+ */
+int cObjInvoke(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	cObj *oPtr=NULL;
+	ObjCmdClientData cdata;
+	int result;
+	if (cObjAcquire(interp,objv[2],&oPtr)!=TCL_OK) return TCL_ERROR;
+	if (!(oPtr->flags & COBJ_FLAG_POOLED)) {
+		Tcl_AppendResult(interp,"object ",Tcl_GetString(objv[2]),
+				" has no subcommands",NULL);
+		cObjRelease(oPtr);
+		return TCL_ERROR;
+	}
+	cdata=((cObjBlock*)oPtr)->cdata;
+	cdata.state=(StateManager_t)data;
+	result=cObjInstanceCall((ClientData)&cdata,interp,objc-2,objv+2,1);
+	cObjRelease(oPtr);
+	return result;
+}
+
+/* cObjConfigure --
+ * Implements "cobj configure ?option? ?value option value ...?". The
+ * options are:
+ *  -commands bool
+ *   whether objects created from now on get an instance command named
+ *   after their handle (the default). Without them, the interpreter's
+ *   command table stays small however many objects are alive, and the
+ *   objects are used through "cobj invoke".
+ *  -shared bool
+ *   whether the objects of this interpreter live in the registry shared
+ *   by all interpreters of the process that set this option, see
+ *   cObjState_Share(). It can only be turned on, and only while the
+ *   interpreter has no objects. Shared objects have no commands.
+ *  -teardownthreads n
+ *   the number of threads freeing the objects when the interpreter (or
+ *   the cobj command) is deleted, 0 for one per processor. With the
+ *   default of 1, all are freed on the thread deleting it. Otherwise the
+ *   objects of COBJ_TYPE_THREAD_SAFE types which nothing else retains
+ *   are freed in parallel, and the deletion returns once all are.
+ *
+ * Results:
+ *  A standard Tcl command result.
+ */
+int cObjConfigure(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	StateManager_t statePtr=(StateManager_t)data;
+	struct cObjStateContext *ctx=CONTEXT(statePtr);
+	CONST char *options[] = {"-commands","-shared","-teardownthreads",NULL};
+	enum optionIx { CommandsIx, SharedIx, TeardownThreadsIx };
+	Tcl_Obj *resultObj=NULL;
+	int i, index, value;
+
+	if (objc==2) {
+		resultObj=Tcl_NewListObj(0,NULL);
+		Tcl_ListObjAppendElement(NULL,resultObj,Tcl_NewStringObj("-commands",-1));
+		Tcl_ListObjAppendElement(NULL,resultObj,Tcl_NewBooleanObj(ctx->commands));
+		Tcl_ListObjAppendElement(NULL,resultObj,Tcl_NewStringObj("-shared",-1));
+		Tcl_ListObjAppendElement(NULL,resultObj,
+				Tcl_NewBooleanObj(statePtr->shared!=NULL));
+		Tcl_ListObjAppendElement(NULL,resultObj,Tcl_NewStringObj("-teardownthreads",-1));
+		Tcl_ListObjAppendElement(NULL,resultObj,Tcl_NewIntObj(statePtr->teardown_threads));
+		Tcl_SetObjResult(interp,resultObj);
+		return TCL_OK;
+	}
+	if (objc==3) {
+		if (Tcl_GetIndexFromObj(interp,objv[2],options,"option",0,&index)!=TCL_OK)
+			return TCL_ERROR;
+		switch (index) {
+			case CommandsIx:
+				Tcl_SetObjResult(interp,Tcl_NewBooleanObj(ctx->commands));
+				break;
+			case SharedIx:
+				Tcl_SetObjResult(interp,Tcl_NewBooleanObj(statePtr->shared!=NULL));
+				break;
+			case TeardownThreadsIx:
+				Tcl_SetObjResult(interp,Tcl_NewIntObj(statePtr->teardown_threads));
+				break;
+		}
+		return TCL_OK;
+	}
+	if (objc%2!=0) {
+		Tcl_WrongNumArgs(interp,2,objv,"?option? ?value option value ...?");
+		return TCL_ERROR;
+	}
+	for (i=2;i<objc;i+=2) {
+		if (Tcl_GetIndexFromObj(interp,objv[i],options,"option",0,&index)!=TCL_OK)
+			return TCL_ERROR;
+		switch (index) {
+			case CommandsIx:
+				if (Tcl_GetBooleanFromObj(interp,objv[i+1],&value)!=TCL_OK)
+					return TCL_ERROR;
+				if (value && statePtr->shared!=NULL) {
+					Tcl_AppendResult(interp,"objects of a shared registry have no commands",NULL);
+					return TCL_ERROR;
+				}
+				ctx->commands=value;
+				break;
+			case SharedIx:
+				if (Tcl_GetBooleanFromObj(interp,objv[i+1],&value)!=TCL_OK)
+					return TCL_ERROR;
+				if (value) {
+					if (cObjState_Share(interp)!=TCL_OK) return TCL_ERROR;
+				} else if (statePtr->shared!=NULL) {
+					Tcl_AppendResult(interp,"a shared registry cannot be made private again",NULL);
+					return TCL_ERROR;
+				}
+				break;
+			case TeardownThreadsIx:
+				if (Tcl_GetIntFromObj(interp,objv[i+1],&value)!=TCL_OK)
+					return TCL_ERROR;
+				if (value<0) {
+					Tcl_AppendResult(interp,"expected a non-negative number of threads but got \"",
+							Tcl_GetString(objv[i+1]),"\"",NULL);
+					return TCL_ERROR;
+				}
+				statePtr->teardown_threads=value;
+				break;
+		}
+	}
+	return TCL_OK;
+}
+
+/* free the payload and the cObj itself */
+static void cObjFreePayload(cObj *oPtr)
+{
+	if (oPtr->deleteFunc!=NULL) {
+		if (oPtr->flags & COBJ_FLAG_ASYNC_DELETE)
+			cObjReclaimQueue(oPtr->deleteFunc,oPtr->object);
+		else
+			oPtr->deleteFunc(oPtr->object);
+	}
+}
+
+static void cObjFree(cObj *oPtr)
+{
+	cObjFreePayload(oPtr);
+	if (oPtr->flags & COBJ_FLAG_POOLED) {
+		cObjBlockFree((cObjBlock*)oPtr);
+	} else {
+		ckfree((char*)oPtr);
+	}
+}
+
+void *cObjInlineStorage(cObj *oPtr, size_t size)
+{
+	/* the reclaim thread would run the deleteFunc on a recycled block */
+	if (!(oPtr->flags & COBJ_FLAG_POOLED) || (oPtr->flags & COBJ_FLAG_ASYNC_DELETE)
+			|| size>COBJ_INLINE_SIZE)
+		return NULL;
+	oPtr->flags|=COBJ_FLAG_INLINE;
+	return ((cObjBlock*)oPtr)->storage.bytes;
+}
+
+void cObjRetain(cObj *oPtr)
+{
+	if (oPtr->flags & COBJ_FLAG_SHARED) {
+		cObjSharedAdd(oPtr,1);
+		return;
+	}
+	oPtr->refcount++;
+}
+
+void cObjRelease(cObj *oPtr)
+{
+	if (oPtr->flags & COBJ_FLAG_SHARED) {
+		if (cObjSharedAdd(oPtr,-1)>0) return;
+	} else if (oPtr->refcount>1) {
+		oPtr->refcount--;
+		return;
+	} else {
+		oPtr->refcount=0;
+	}
+	// an autofree object still owns its name until the last handle goes
+	if ((oPtr->flags & (COBJ_FLAG_AUTOFREE|COBJ_FLAG_UNREGISTERED))==COBJ_FLAG_AUTOFREE) {
+		oPtr->flags|=COBJ_FLAG_UNREGISTERED;
+		cObjUncount(oPtr);
+		varUnregisterHandle(((cObjBlock*)oPtr)->cdata.state,((cObjBlock*)oPtr)->handle);
+	}
+	cObjFree(oPtr);
+}
+
+/* "cobj delete" leaves objects alone while a script holds a reference
+ * taken by retain, as nothing could give it back once the name is gone;
+ * a varDeleteCheckFunction */
+static int cObjDeleteCheck(ClientData element)
+{
+	cObj *oPtr=(cObj*)element;
+	if (!(oPtr->flags & COBJ_FLAG_POOLED)) return 1;
+#if defined(__GNUC__)
+	return __atomic_load_n(&((cObjBlock*)oPtr)->retained,__ATOMIC_ACQUIRE)==0;
+#else
+	return ((cObjBlock*)oPtr)->retained==0;
+#endif
+}
+
+/* The delete proc of the state manager: the object has been unregistered,
+ * so drop its command and the registry's reference, and the references
+ * retain took if it goes with its state. Autofree objects are left to
+ * their handles. */
+void cObjDelete(void *ptr)
+{
+	cObj *oPtr=(cObj *)ptr;
+	cObjBlock *block=NULL;
+	Tcl_Command token;
 	if (oPtr==NULL) return;
-	if (oPtr->deleteFunc!=NULL) oPtr->deleteFunc(oPtr->object);
-	ckfree((char*)oPtr);
+	oPtr->flags|=COBJ_FLAG_UNREGISTERED;
+	cObjUncount(oPtr);
+	if (oPtr->flags & COBJ_FLAG_POOLED) {
+		while (cObjRetainedAdd((cObjBlock*)oPtr,-1)) cObjRelease(oPtr);
+	}
+	if (oPtr->flags & COBJ_FLAG_AUTOFREE) return;
+	if (oPtr->flags & COBJ_FLAG_POOLED) {
+		// the instance command would be left pointing into a recycled block
+		block=(cObjBlock*)oPtr;
+		token=block->cdata.token;
+		if (token!=NULL && block->cdata.state->interp!=NULL) {
+			block->cdata.token=NULL;
+			Tcl_DeleteCommandFromToken(block->cdata.state->interp,token);
+		}
+	}
+	cObjRelease(oPtr);
 	return;
 }
 
+/* The teardownProc of the state manager. An object of a thread-safe type
+ * referenced only by its name can have its cObjDelete() run on another
+ * thread, once its command is gone. The pool is locked from then on. */
+static int cObjTeardown(ClientData element)
+{
+	cObj *oPtr=(cObj*)element;
+	cObjBlock *block=(cObjBlock*)oPtr;
+	Tcl_Command token=block->cdata.token;
+	if ((oPtr->flags & (COBJ_FLAG_POOLED|COBJ_FLAG_AUTOFREE|COBJ_FLAG_ASYNC_DELETE
+					|COBJ_FLAG_SHARED))!=COBJ_FLAG_POOLED)
+		return 0;
+	if (oPtr->refcount!=1 || oPtr->type==NULL
+			|| !(oPtr->type->flags & COBJ_TYPE_THREAD_SAFE))
+		return 0;
+	if (token!=NULL && block->cdata.state->interp!=NULL) {
+		block->cdata.token=NULL;
+		Tcl_DeleteCommandFromToken(block->cdata.state->interp,token);
+	}
+	if (!block->ctx->teardown) {
+		/* Tcl creates a mutex on first use */
+		Tcl_MutexLock(&block->ctx->lock);
+		Tcl_MutexUnlock(&block->ctx->lock);
+		block->ctx->teardown=1;
+	}
+	return 1;
+}
+
+/* "cobj foreach" calls the subcommand on a snapshot of the objects of
+ * the type, each retained until all calls are done. Calls made on the
+ * thread of the command use its interpreter and arguments; the pool
+ * threads of varParallelApply() each use an interpreter of their own,
+ * created on first use and deleted when the thread exits, and copies of
+ * the arguments, since Tcl_Objs can't be shared between threads. Each
+ * call gets the name of its object as objv[0], as if invoked through
+ * its handle. */
+typedef struct cObjForEachItem {
+	cObj *oPtr;
+	char *name;
+} cObjForEachItem;
+
+typedef struct cObjForEach {
+	StateManager_t state;
+	Tcl_Interp *interp;
+	Tcl_ThreadId thread;
+	unsigned long serial; /* tells the argument copies of each call apart */
+	int objc;
+	Tcl_Obj **objv;
+	const char **argv; /* the strings of objv, for the copies */
+	char *error; /* the message of the first failure */
+} cObjForEach;
+
+typedef struct cObjForEachThread {
+	Tcl_Interp *interp;
+	unsigned long serial;
+	int objc;
+	Tcl_Obj **objv;
+} cObjForEachThread;
+
+TCL_DECLARE_MUTEX(foreachMutex)
+static unsigned long foreachSerial=0;
+static Tcl_ThreadDataKey foreachKey;
+
+static void cObjForEachArgsFree(cObjForEachThread *tsdPtr)
+{
+	int i;
+	for (i=0;i<tsdPtr->objc;i++) {
+		if (tsdPtr->objv[i]!=NULL) Tcl_DecrRefCount(tsdPtr->objv[i]);
+	}
+	if (tsdPtr->objv!=NULL) ckfree((char*)tsdPtr->objv);
+	tsdPtr->objv=NULL;
+	tsdPtr->objc=0;
+}
+
+static void cObjForEachThreadExit(ClientData data)
+{
+	cObjForEachThread *tsdPtr=(cObjForEachThread*)data;
+	cObjForEachArgsFree(tsdPtr);
+	Tcl_DeleteInterp(tsdPtr->interp);
+	tsdPtr->interp=NULL;
+}
+
+/* call the subcommand on one object; a varForEachFunction */
+static int cObjForEachCall(ClientData element, ClientData clientData)
+{
+	cObjForEach *fe=(cObjForEach*)clientData;
+	cObjForEachItem *item=(cObjForEachItem*)element;
+	cObjForEachThread *tsdPtr=NULL;
+	ObjCmdClientData cdata;
+	Tcl_Interp *interp=fe->interp;
+	Tcl_Obj **objv=fe->objv;
+	int i, result;
+	if (Tcl_GetCurrentThread()!=fe->thread) {
+		tsdPtr=(cObjForEachThread*)Tcl_GetThreadData(&foreachKey,
+				sizeof(cObjForEachThread));
+		if (tsdPtr->interp==NULL) {
+			tsdPtr->interp=Tcl_CreateInterp();
+			Tcl_CreateThreadExitHandler(cObjForEachThreadExit,(ClientData)tsdPtr);
+		}
+		if (tsdPtr->serial!=fe->serial) {
+			cObjForEachArgsFree(tsdPtr);
+			tsdPtr->objv=(Tcl_Obj**)ckalloc(fe->objc*sizeof(Tcl_Obj*));
+			tsdPtr->objv[0]=NULL;
+			for (i=1;i<fe->objc;i++) {
+				tsdPtr->objv[i]=Tcl_NewStringObj(fe->argv[i],-1);
+				Tcl_IncrRefCount(tsdPtr->objv[i]);
+			}
+			tsdPtr->objc=fe->objc;
+			tsdPtr->serial=fe->serial;
+		}
+		interp=tsdPtr->interp;
+		objv=tsdPtr->objv;
+	}
+	if (objv[0]!=NULL) Tcl_DecrRefCount(objv[0]);
+	objv[0]=Tcl_NewStringObj(item->name,-1);
+	Tcl_IncrRefCount(objv[0]);
+	cdata=((cObjBlock*)item->oPtr)->cdata;
+	cdata.state=fe->state;
+	Tcl_ResetResult(interp);
+	/* the snapshot's reference is not the caller's to release */
+	result=cObjInstanceCall((ClientData)&cdata,interp,fe->objc,objv,1);
+	if (result!=TCL_OK) {
+		Tcl_MutexLock(&foreachMutex);
+		if (fe->error==NULL) {
+			fe->error=ckalloc(strlen(Tcl_GetStringResult(interp))+1);
+			strcpy(fe->error,Tcl_GetStringResult(interp));
+		}
+		Tcl_MutexUnlock(&foreachMutex);
+	}
+	return result;
+}
+
+typedef struct cObjForEachSnapshot {
+	cObjForEachItem *items;
+	int len, max;
+} cObjForEachSnapshot;
+
+/* retain an object for the snapshot; a varScanFunction */
+static void cObjForEachTake(ClientData element, const char *name,
+		ClientData clientData)
+{
+	cObjForEachSnapshot *snap=(cObjForEachSnapshot*)clientData;
+	cObjForEachItem *item;
+	if (!(((cObj*)element)->flags & COBJ_FLAG_POOLED)) return;
+	if (!cObjTryRetain(element)) return;
+	if (snap->len==snap->max) {
+		snap->max=(snap->max==0) ? 64 : 2*snap->max;
+		snap->items=(cObjForEachItem*)ckrealloc((char*)snap->items,
+				snap->max*sizeof(cObjForEachItem));
+	}
+	item=&snap->items[snap->len++];
+	item->oPtr=(cObj*)element;
+	item->name=ckalloc(strlen(name)+1);
+	strcpy(item->name,name);
+}
+
+/* cObjForEachCmd --
+ * Implements "cobj foreach -type type ?-parallel? ?-threads n? subcommand
+ * ?arg ...?", calling "$handle subcommand ?arg ...?" for every object of
+ * the type (objects made by the C API, without subcommands, are skipped).
+ * -parallel spreads the calls over a thread per processor, -threads over
+ * n threads; the type must then be COBJ_TYPE_THREAD_SAFE, and the calls
+ * made on other threads only see an empty interpreter of their own. The
+ * order of the calls is unspecified, and results other than errors are
+ * discarded. A failing call does not stop the others.
+ *
+ * Results:
+ *  A standard Tcl command result. The result is the number of calls made.
+ */
+int cObjForEachCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	StateManager_t statePtr=(StateManager_t)data;
+	CONST char *options[] = {"-parallel","-threads","-type",NULL};
+	enum optionIx { ParallelIx, ThreadsIx, TypeIx };
+	cObjType *typePtr=NULL;
+	cObjForEachSnapshot snap={NULL,0,0};
+	cObjForEach fe;
+	ClientData *elements;
+	uint64_t position=0;
+	char buf[2*TCL_INTEGER_SPACE+32];
+	int i, index, parallel=0, nthreads=0, failures=0, result=TCL_OK;
+
+	for (i=2;i<objc;i++) {
+		if (Tcl_GetString(objv[i])[0]!='-') break;
+		if (Tcl_GetIndexFromObj(interp,objv[i],options,"option",0,&index)!=TCL_OK)
+			return TCL_ERROR;
+		switch (index) {
+			case ParallelIx:
+				parallel=1;
+				break;
+			case ThreadsIx:
+				if (i+1>=objc) goto wrongArgs;
+				if (Tcl_GetIntFromObj(interp,objv[++i],&nthreads)!=TCL_OK)
+					return TCL_ERROR;
+				if (nthreads<1) {
+					Tcl_AppendResult(interp,"expected a positive number of threads but got \"",
+							Tcl_GetString(objv[i]),"\"",NULL);
+					return TCL_ERROR;
+				}
+				parallel=1;
+				break;
+			case TypeIx:
+				if (i+1>=objc) goto wrongArgs;
+				if (cObjTypeFromObj(interp,statePtr,objv[++i],&typePtr)!=TCL_OK)
+					return TCL_ERROR;
+				break;
+		}
+	}
+	if (typePtr==NULL || i>=objc) goto wrongArgs;
+	if (parallel && !(typePtr->flags & COBJ_TYPE_THREAD_SAFE)) {
+		Tcl_AppendResult(interp,"type `",typePtr->name,
+				"' does not declare its subcommands thread-safe",NULL);
+		return TCL_ERROR;
+	}
+
+	do {
+		if (varScan(interp,statePtr,&position,1024,NULL,typePtr->name,
+					cObjForEachTake,(ClientData)&snap)!=TCL_OK) {
+			result=TCL_ERROR;
+			break;
+		}
+	} while (position!=0);
+
+	if (result==TCL_OK && snap.len>0) {
+		memset(&fe,0,sizeof(fe));
+		fe.state=statePtr;
+		fe.interp=interp;
+		fe.thread=Tcl_GetCurrentThread();
+		fe.objc=objc-i+1;
+		fe.objv=(Tcl_Obj**)ckalloc(fe.objc*sizeof(Tcl_Obj*));
+		fe.argv=(const char**)ckalloc(fe.objc*sizeof(char*));
+		/* objv[0], the name of the object, is set by each call */
+		fe.objv[0]=NULL;
+		fe.argv[0]=NULL;
+		memcpy(fe.objv+1,objv+i,(objc-i)*sizeof(Tcl_Obj*));
+		for (i=1;i<fe.objc;i++) fe.argv[i]=Tcl_GetString(fe.objv[i]);
+		Tcl_MutexLock(&foreachMutex);
+		fe.serial=++foreachSerial;
+		Tcl_MutexUnlock(&foreachMutex);
+
+		elements=(ClientData*)ckalloc(snap.len*sizeof(ClientData));
+		for (i=0;i<snap.len;i++) elements[i]=(ClientData)&snap.items[i];
+		failures=varParallelApply(elements,snap.len,cObjForEachCall,
+				(ClientData)&fe,parallel ? nthreads : 1);
+		ckfree((char*)elements);
+
+		Tcl_ResetResult(interp);
+		if (failures>0) {
+			sprintf(buf,"%d of %d calls failed, the first with: ",failures,snap.len);
+			Tcl_AppendResult(interp,buf,fe.error,NULL);
+			result=TCL_ERROR;
+		}
+		if (fe.error!=NULL) ckfree(fe.error);
+		if (fe.objv[0]!=NULL) Tcl_DecrRefCount(fe.objv[0]);
+		ckfree((char*)fe.objv);
+		ckfree((char*)fe.argv);
+	}
+	for (i=0;i<snap.len;i++) {
+		cObjRelease(snap.items[i].oPtr);
+		ckfree(snap.items[i].name);
+	}
+	if (snap.items!=NULL) ckfree((char*)snap.items);
+	if (result==TCL_OK) Tcl_SetObjResult(interp,Tcl_NewIntObj(snap.len));
+	return result;
+
+wrongArgs:
+	Tcl_WrongNumArgs(interp,2,objv,
+			"-type type ?-parallel? ?-threads n? subcommand ?arg ...?");
+	return TCL_ERROR;
+}
+
+/* Transfers to another thread are delivered to the first interpreter
+ * of that thread that initialized the cobj layer, its port. Events are
+ * only queued to threads with a port, under transferMutex; once the last
+ * port of a thread goes (with its interpreter, or when the thread exits)
+ * the transfers still queued there are dropped, freeing their objects,
+ * since Tcl would discard the events without running them. */
+typedef struct cObjPort {
+	Tcl_ThreadId thread;
+	Tcl_Interp *interp;
+	struct cObjPort *next;
+} cObjPort;
+
+TCL_DECLARE_MUTEX(transferMutex)
+static cObjPort *ports=NULL; /* in order of creation */
+static unsigned long transferUid=0;
+static Tcl_ThreadDataKey portKey; /* an int, set once the exit handler is */
+
+static int  cObjTransferEventProc(Tcl_Event *evPtr, int flags);
+static void cObjTransferDrain(void);
+
+/* remove the port of interp, or all ports of the current thread if
+ * interp is NULL; then drop the transfers queued to this thread if it
+ * has no port left */
+static void cObjPortRemove(ClientData data, Tcl_Interp *interp)
+{
+	cObjPort **pp, *port;
+	Tcl_ThreadId thread=Tcl_GetCurrentThread();
+	int left=0;
+	(void)data;
+	Tcl_MutexLock(&transferMutex);
+	pp=&ports;
+	while (*pp!=NULL) {
+		port=*pp;
+		if (interp==NULL ? port->thread==thread : port->interp==interp) {
+			*pp=port->next;
+			ckfree((char*)port);
+			continue;
+		}
+		if (port->thread==thread) left=1;
+		pp=&port->next;
+	}
+	Tcl_MutexUnlock(&transferMutex);
+	if (!left) cObjTransferDrain();
+}
+
+/* the thread may exit without deleting its interpreters */
+static void cObjPortThreadExit(ClientData data)
+{
+	(void)data;
+	cObjPortRemove(NULL,NULL);
+}
+
+static void cObjPortAdd(Tcl_Interp *interp)
+{
+	cObjPort **pp, *port;
+	int *exitHandlerPtr=(int*)Tcl_GetThreadData(&portKey,sizeof(int));
+	port=(cObjPort*)ckalloc(sizeof(cObjPort));
+	port->thread=Tcl_GetCurrentThread();
+	port->interp=interp;
+	port->next=NULL;
+	Tcl_MutexLock(&transferMutex);
+	for (pp=&ports;*pp!=NULL;pp=&(*pp)->next) ;
+	*pp=port;
+	Tcl_MutexUnlock(&transferMutex);
+	Tcl_CallWhenDeleted(interp,cObjPortRemove,NULL);
+	if (!*exitHandlerPtr) {
+		Tcl_CreateThreadExitHandler(cObjPortThreadExit,NULL);
+		*exitHandlerPtr=1;
+	}
+}
+
+/* the port of a thread, or NULL. Only the thread itself may use it. */
+static Tcl_Interp *cObjPortFind(Tcl_ThreadId thread)
+{
+	cObjPort *port;
+	Tcl_Interp *interp=NULL;
+	Tcl_MutexLock(&transferMutex);
+	for (port=ports;port!=NULL;port=port->next) {
+		if (port->thread==thread) {
+			interp=port->interp;
+			break;
+		}
+	}
+	Tcl_MutexUnlock(&transferMutex);
+	return interp;
+}
+
+/* find the descriptor of a type in the state objects are moved to */
+static cObjType *cObjTransferType(StateManager_t statePtr, const char *type_name)
+{
+	cObjType *typePtr;
+	varLock(statePtr);
+	typePtr=cObjLookupType(statePtr->root,type_name);
+	varUnlock(statePtr);
+	return typePtr;
+}
+
+/* Register a detached object under name in the state of the target,
+ * in a new block of its pool. Only the cObj itself is copied. */
+static void cObjAttach(StateManager_t statePtr, Tcl_Interp *interp,
+		const cObj *moved, cObjType *typePtr, const char *name)
+{
+	cObjBlock *block=cObjBlockAlloc(POOL(statePtr));
+	cObj *oPtr=&block->obj;
+	ObjCmdClientData *cdata=&block->cdata;
+	*oPtr=*moved;
+	oPtr->type=typePtr;
+	oPtr->flags=COBJ_FLAG_POOLED | (moved->flags & COBJ_FLAG_ASYNC_DELETE);
+	if (statePtr->shared!=NULL) oPtr->flags|=COBJ_FLAG_SHARED;
+	oPtr->refcount=1;
+	cObjCount(oPtr);
+	registerVar(interp,statePtr,(ClientData)oPtr,(char*)name,REG_VAR_DELETE_OLD);
+	varHandleFromName(statePtr,name,&block->handle);
+	cdata->state=statePtr->root;
+	cdata->mSelf=oPtr;
+	cdata->instanceCommand=typePtr->instanceCommand;
+	if (CONTEXT(statePtr)->commands) {
+		cdata->token=Tcl_CreateObjCommand(interp,name,cObjInstanceCmd,
+				(ClientData)cdata,cObjInstanceDeleted);
+	}
+}
+
+/* a transfer on its way to another thread */
+typedef struct cObjTransferEvent {
+	Tcl_Event header; /* must come first */
+	cObj obj; /* detached copy, the payload is untouched */
+	char *type_name;
+	char name[1]; /* the new name, allocated with the event */
+} cObjTransferEvent;
+
+/* the objects of the transfers dropped by cObjTransferDrain() */
+typedef struct cObjTransferDrained {
+	cObj *objs;
+	int len, max;
+} cObjTransferDrained;
+
+/* a Tcl_EventDeleteProc: take the object out of a queued transfer.
+ * Tcl holds its queue lock here, so the payloads are freed afterwards. */
+static int cObjTransferDeleteProc(Tcl_Event *evPtr, ClientData clientData)
+{
+	cObjTransferDrained *d=(cObjTransferDrained*)clientData;
+	cObjTransferEvent *ev=(cObjTransferEvent*)evPtr;
+	if (evPtr->proc!=cObjTransferEventProc) return 0;
+	if (d->len==d->max) {
+		d->max=(d->max==0) ? 16 : 2*d->max;
+		d->objs=(cObj*)ckrealloc((char*)d->objs,d->max*sizeof(cObj));
+	}
+	d->objs[d->len++]=ev->obj;
+	ckfree(ev->type_name);
+	return 1;
+}
+
+/* drop the transfers queued to the current thread */
+static void cObjTransferDrain(void)
+{
+	cObjTransferDrained d={NULL,0,0};
+	int i;
+	Tcl_DeleteEvents(cObjTransferDeleteProc,(ClientData)&d);
+	for (i=0;i<d.len;i++) cObjFreePayload(&d.objs[i]);
+	if (d.objs!=NULL) ckfree((char*)d.objs);
+}
+
+/* queue a transfer to thread, if it still has a port; returns 1 if so */
+static int cObjTransferQueue(Tcl_ThreadId thread, cObjTransferEvent *ev)
+{
+	cObjPort *port;
+	int queued=0;
+	Tcl_MutexLock(&transferMutex);
+	for (port=ports;port!=NULL;port=port->next) {
+		if (port->thread==thread) {
+			Tcl_ThreadQueueEvent(thread,(Tcl_Event*)ev,TCL_QUEUE_TAIL);
+			Tcl_ThreadAlert(thread);
+			queued=1;
+			break;
+		}
+	}
+	Tcl_MutexUnlock(&transferMutex);
+	return queued;
+}
+
+/* runs on the target thread; if its port went away meanwhile, or does
+ * not know the type, the object is freed there */
+static int cObjTransferEventProc(Tcl_Event *evPtr, int flags)
+{
+	cObjTransferEvent *ev=(cObjTransferEvent*)evPtr;
+	Tcl_Interp *interp=cObjPortFind(Tcl_GetCurrentThread());
+	StateManager_t statePtr=NULL;
+	cObjType *typePtr=NULL;
+	(void)flags;
+	if (interp!=NULL)
+		statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	if (statePtr!=NULL) typePtr=cObjTransferType(statePtr,ev->type_name);
+	if (typePtr!=NULL) {
+		cObjAttach(statePtr,interp,&ev->obj,typePtr,ev->name);
+	} else {
+		if (statePtr!=NULL) {
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp,"object ",ev->name," dropped: type `",
+					ev->type_name,"' is not registered",NULL);
+			Tcl_BackgroundException(interp,TCL_ERROR);
+		}
+		cObjFreePayload(&ev->obj);
+	}
+	ckfree(ev->type_name);
+	return 1;
+}
+
+int cObjTransfer(Tcl_Interp *interp, Tcl_Obj *CONST handleObj,
+		Tcl_Interp *targetInterp, Tcl_ThreadId targetThread, Tcl_Obj **namePtr)
+{
+	StateManager_t statePtr=NULL, targetPtr=NULL;
+	cObjTransferEvent *ev=NULL;
+	cObjType *typePtr=NULL;
+	cObjBlock *block=NULL;
+	cObj *oPtr=NULL;
+	Tcl_Obj *nameObj=NULL;
+	Tcl_Command token;
+	char tmp[TCL_INTEGER_SPACE+1];
+	size_t len;
+
+	statePtr=(StateManager_t)Tcl_GetAssocData(interp,COBJSTATEKEY,NULL);
+	if (statePtr==NULL) {
+		Tcl_AppendResult(interp,"No state stored by key `",COBJSTATEKEY,"'\n",NULL);
+		return TCL_ERROR;
+	}
+	if (targetInterp==NULL) {
+		if (cObjPortFind(targetThread)==NULL) {
+			Tcl_AppendResult(interp,"no interpreter of the target thread uses cobj",NULL);
+			return TCL_ERROR;
+		}
+		if (targetThread==Tcl_GetCurrentThread())
+			targetInterp=cObjPortFind(targetThread);
+	}
+	if (targetInterp!=NULL) {
+		targetPtr=(StateManager_t)Tcl_GetAssocData(targetInterp,COBJSTATEKEY,NULL);
+		if (targetPtr==NULL || targetPtr->ext==NULL) {
+			Tcl_AppendResult(interp,"the target interpreter does not use cobj",NULL);
+			return TCL_ERROR;
+		}
+	}
+	if (cObjFromHandle(interp,handleObj,&oPtr)!=TCL_OK) return TCL_ERROR;
+	if (targetPtr==statePtr) {
+		*namePtr=Tcl_NewStringObj(Tcl_GetString(handleObj),-1);
+		return TCL_OK;
+	}
+	/* anything holding on to the cObj would be left dangling */
+	if (!(oPtr->flags & COBJ_FLAG_POOLED) || (oPtr->flags & COBJ_FLAG_AUTOFREE)
+			|| oPtr->refcount!=1) {
+		Tcl_AppendResult(interp,"object ",Tcl_GetString(handleObj),
+				" is not owned by its name alone",NULL);
+		return TCL_ERROR;
+	}
+	if (oPtr->flags & COBJ_FLAG_SHARED) {
+		Tcl_AppendResult(interp,"object ",Tcl_GetString(handleObj),
+				" is already visible to all interpreters sharing the registry",NULL);
+		return TCL_ERROR;
+	}
+	if (oPtr->flags & COBJ_FLAG_INLINE) {
+		Tcl_AppendResult(interp,"object ",Tcl_GetString(handleObj),
+				" is stored in its block and can't move",NULL);
+		return TCL_ERROR;
+	}
+	if (targetPtr!=NULL) {
+		typePtr=cObjTransferType(targetPtr,oPtr->type->name);
+		if (typePtr==NULL) {
+			Tcl_AppendResult(interp,"type `",oPtr->type->name,
+					"' is not registered in the target interpreter",NULL);
+			return TCL_ERROR;
+		}
+		if (varUniqNameObj(targetInterp,targetPtr,&nameObj)!=TCL_OK) return TCL_ERROR;
+	} else {
+		/* the target's own names are numbers after the prefix */
+		Tcl_MutexLock(&transferMutex);
+		sprintf(tmp,"t%04lu",++transferUid);
+		Tcl_MutexUnlock(&transferMutex);
+		nameObj=Tcl_NewStringObj(statePtr->prefix,-1);
+		Tcl_AppendToObj(nameObj,tmp,-1);
+	}
+
+	/* detach it: the name goes without calling deleteProc */
+	block=(cObjBlock*)oPtr;
+	varUnregisterHandle(statePtr,block->handle);
+	cObjUncount(oPtr);
+	token=block->cdata.token;
+	if (token!=NULL) {
+		block->cdata.token=NULL;
+		Tcl_DeleteCommandFromToken(interp,token);
+	}
+	if (targetPtr!=NULL) {
+		cObjAttach(targetPtr,targetInterp,oPtr,typePtr,Tcl_GetString(nameObj));
+	} else {
+		len=strlen(Tcl_GetString(nameObj));
+		ev=(cObjTransferEvent*)ckalloc(sizeof(cObjTransferEvent)+len);
+		ev->header.proc=cObjTransferEventProc;
+		ev->obj=*oPtr;
+		ev->type_name=(char*)ckalloc(strlen(oPtr->type->name)+1);
+		strcpy(ev->type_name,oPtr->type->name);
+		memcpy(ev->name,Tcl_GetString(nameObj),len+1);
+		if (!cObjTransferQueue(targetThread,ev)) {
+			/* the thread lost its port meanwhile: put the object back */
+			cObjAttach(statePtr,interp,oPtr,(cObjType*)oPtr->type,
+					Tcl_GetString(handleObj));
+			cObjBlockFree(block);
+			ckfree(ev->type_name);
+			ckfree((char*)ev);
+			Tcl_DecrRefCount(nameObj);
+			Tcl_AppendResult(interp,"no interpreter of the target thread uses cobj",NULL);
+			return TCL_ERROR;
+		}
+	}
+	cObjBlockFree(block);
+	*namePtr=nameObj;
+	return TCL_OK;
+}
+
+/* cObjTransferCmd --
+ * Implements "cobj transfer <handle> <target>". The target is the path
+ * of an interpreter of this thread, as for "interp eval", or the id of
+ * a thread as returned by "thread::id". Returns the name of the object
+ * in the target.
+ *
+ * Results:
+ *  A standard Tcl command result.
+ */
+int cObjTransferCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	Tcl_Interp *targetInterp=NULL;
+	Tcl_ThreadId thread=NULL;
+	Tcl_Obj *nameObj=NULL;
+	const char *target=Tcl_GetString(objv[3]);
+	void *ptr=NULL;
+	(void)data;
+	(void)objc;
+
+	targetInterp=Tcl_GetChild(interp,target);
+	if (targetInterp==NULL) {
+		/* the form of the ids of the Thread package */
+		if (strncmp(target,"tid",3)!=0 || sscanf(target+3,"%p",&ptr)!=1) {
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp,"bad target \"",target,
+					"\": must be an interpreter or a thread id",NULL);
+			return TCL_ERROR;
+		}
+		Tcl_ResetResult(interp);
+		thread=(Tcl_ThreadId)ptr;
+	}
+	if (cObjTransfer(interp,objv[2],targetInterp,thread,&nameObj)!=TCL_OK)
+		return TCL_ERROR;
+	Tcl_SetObjResult(interp,nameObj);
+	return TCL_OK;
+}
+
 /* Hash a string to an integer using the FNV1a Hashing algorithm */
 uint64_t FNV1aHash(const char *str, int maxlen) {
 	int i;
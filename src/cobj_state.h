@@ -39,17 +39,82 @@ extern "C" {
 
 typedef struct cObjStateContext *cObjStateContextPtr;
 
+/** An entry of a type's subcommand table, see registerNewTypeMethods().
+ * Tables are static and end with an entry whose name is NULL. The proc
+ * is called exactly like a type's instance command. */
+typedef struct cObjMethod {
+	const char *name;
+	InstanceCommandFunc proc;
+} cObjMethod;
+
+/** Bytes used by the payload of an object (the cObj's object field),
+ * for the accounting of "cobj memory". */
+typedef size_t (*cObjSizeFunc)(void *object);
+
+/** Descriptor of a registered object type. It is created once by
+ * registerNewTypeEx() and lives as long as the state manager, so callers
+ * can keep it around and check types with a single integer compare
+ * instead of hashing the type name on every lookup. */
+typedef struct cObjType {
+	const char *name; /**< name of the type, as given to "cobj create" */
+	uint64_t hash; /**< TYPEHASH(name,-1) */
+	CreateObjFunc createProc;
+	InstanceCommandFunc instanceCommand; /**< may be NULL if methods are given */
+	unsigned long serial; /**< unique within the process */
+	const cObjMethod *methods; /**< subcommand table, sorted by name */
+	int num_methods;
+	struct cObjType *next_same_hash; /**< chain of types whose hashes collide */
+	int flags; /**< COBJ_TYPE_* bits, set right after registration */
+	cObjSizeFunc sizeFunc; /**< may be NULL; set right after registration */
+	/* registered objects of the type and the sum of their sizes, kept up
+	 * to date as they come and go, see cObjGetMemoryInfo() */
+	long num_objects;
+	uint64_t num_bytes;
+} cObjType;
+
+/* Run the deleteFunc of objects of this type on a background thread.
+ * The object's name and command go away immediately, but the payload is
+ * freed later, so deleteFunc must not touch the interpreter and must be
+ * safe to run on another thread. */
+#define COBJ_TYPE_ASYNC_DELETE 0x1
+/* The subcommands of this type may run on several objects at once from
+ * different threads, each with its own interpreter, as "cobj foreach
+ * -parallel" does. So may the deleteFunc, as with "cobj configure
+ * -teardownthreads". */
+#define COBJ_TYPE_THREAD_SAFE 0x2
+
 /** A data structure that hold cvobject (which can be a camera, kinect, img,
  * ptcloud ...) */
 typedef struct cObj {
 	char type_name[64]; /**< name of this object's type */
 	uint64_t type_hash; /**< a hash of the name of the type */
-	uint64_t refcount; /**< a reference count for optional resource management */
+	uint64_t refcount; /**< references held, see cObjRetain() */
 	void *object;
 	void (*deleteFunc)(void *ptr);
 	cObjStateContextPtr *context;
+	const cObjType *type; /**< descriptor of the type that created this object */
+	unsigned int flags; /**< COBJ_FLAG_* bits, managed by cobj_state.c */
+	size_t size; /**< from the type's sizeFunc, see cObjUpdateSize() */
 } cObj;
 
+/* the cObj was allocated from its state's block pool */
+#define COBJ_FLAG_POOLED 0x1
+/* the object is owned by its handles, see "cobj create -autofree" */
+#define COBJ_FLAG_AUTOFREE 0x2
+/* the name of the object has been removed from the registry */
+#define COBJ_FLAG_UNREGISTERED 0x4
+/* the deleteFunc runs on the reclaim thread, see COBJ_TYPE_ASYNC_DELETE */
+#define COBJ_FLAG_ASYNC_DELETE 0x8
+/* the object lives in a shared registry, its refcount is atomic */
+#define COBJ_FLAG_SHARED 0x10
+/* the object is in the num_objects and num_bytes of its type */
+#define COBJ_FLAG_COUNTED 0x20
+/* the payload lives in the block of the cObj, see cObjInlineStorage() */
+#define COBJ_FLAG_INLINE 0x40
+
+/* bytes a pooled object can keep its payload in, see cObjInlineStorage() */
+#define COBJ_INLINE_SIZE 64
+
 /* a structure passed to clientData of Object commands,
  * which holds the overall Object states (to provide
  * access to other Objectvariables) as well
@@ -60,16 +125,65 @@ typedef struct ObjCmdClientData {
 	StateManager_t state;
 	cObj *mSelf;
 	InstanceCommandFunc instanceCommand;
+	Tcl_Command token; /* the instance command, NULL once deleted */
 } ObjCmdClientData;
 
+/* Occupancy of the pool that objects created by "cobj create" are
+ * allocated from. Each block holds a cObj and its ObjCmdClientData. */
+typedef struct cObjPoolInfo {
+	long slabs; /* number of slabs allocated */
+	long blocks; /* blocks in all slabs */
+	long in_use; /* blocks holding live objects */
+	size_t block_size; /* bytes per block, a multiple of the cache line */
+} cObjPoolInfo;
+
 /* Function that must be called to initialize the state
  * manager.
  */
 extern int  DLLEXPORT cObjState_Init(Tcl_Interp *interp);
+/* Move the objects of the interpreter into the registry shared by all
+ * interpreters of the process that do the same, as "cobj configure
+ * -shared 1" does. Objects created in one of them can then be found by
+ * their handle in all the others, on any thread. The interpreter must not
+ * have any objects yet; its registered types are copied to the shared
+ * registry, which also receives all types registered later. Shared
+ * objects have no instance command and are used through "cobj invoke". */
+extern int  DLLEXPORT cObjState_Share(Tcl_Interp *interp);
 
 // Means to retrieve objects in a friendly way;
 extern int  DLLEXPORT getcObjFromObj(Tcl_Interp *interp, Tcl_Obj *CONST name,
 		const char *type_name, cObj **iPtrPtr);
+/* Same as getcObjFromObj(), but checks the type against a descriptor
+ * obtained from registerNewTypeEx() or cObjGetType(), so no hashing of
+ * the type name takes place. */
+extern int  DLLEXPORT getcObjFromObjType(Tcl_Interp *interp, Tcl_Obj *CONST name,
+		const cObjType *type, cObj **iPtrPtr);
+/* Same again, but against a precomputed TYPEHASH() of the type name */
+extern int  DLLEXPORT getcObjFromObjHash(Tcl_Interp *interp, Tcl_Obj *CONST name,
+		uint64_t type_hash, cObj **iPtrPtr);
+/* Resolve a handle and retain the object, which the caller must
+ * cObjRelease() when done. With a shared registry, the pointers returned
+ * by the functions above may be freed by a delete on another thread at
+ * any time; this one is safe. */
+extern int  DLLEXPORT cObjAcquire(Tcl_Interp *interp, Tcl_Obj *CONST name,
+		cObj **iPtrPtr);
+
+/* Create count objects of a type in one go, as "cobj create <type>
+ * -count n" does. flags may be COBJ_FLAG_AUTOFREE to create them as with
+ * -autofree. objc/objv are passed to the type's create proc for each
+ * object. On success *listPtr is a list of the new handles, holding a
+ * reference the caller must release; on failure no object is left behind. */
+extern int  DLLEXPORT cObjCreateMany(Tcl_Interp *interp, cObjType *typePtr,
+		int count, int flags, int objc, Tcl_Obj *CONST objv[], Tcl_Obj **listPtr);
+
+/* Objects are reference counted. The name registered by "cobj create"
+ * holds one reference, which "cobj delete" drops after unregistering the
+ * name; code sharing the payload takes references of its own with
+ * cObjRetain(), and the deleteFunc runs when the last one is released.
+ * "$obj retain" and "$obj release" do the same from scripts. An object
+ * outliving its name is only reachable through the pointer retained. */
+extern void DLLEXPORT cObjRetain(cObj *oPtr);
+extern void DLLEXPORT cObjRelease(cObj *oPtr);
 
 /* the command bound to each instance */
 extern int  DLLEXPORT cObjInstanceCmd(ClientData data, Tcl_Interp *interp,
@@ -82,7 +196,79 @@ extern int  DLLEXPORT registerNewType(Tcl_Interp *interp, const char *type_name,
 		int (*instanceCommand)
 			(ClientData, Tcl_Interp *, int, Tcl_Obj *CONST objv[])
 		);
+/* as registerNewType(), also returning the descriptor of the new type
+ * in *typePtrPtr (if typePtrPtr is not NULL) */
+extern int  DLLEXPORT registerNewTypeEx(Tcl_Interp *interp, const char *type_name,
+		CreateObjFunc createObjFunc, InstanceCommandFunc instanceCommand,
+		cObjType **typePtrPtr);
+/* Register a type whose subcommands are given by a static table of
+ * name/handler pairs, ending with {NULL,NULL}. The table is sorted once
+ * here, and the resolved entry is cached on the subcommand Tcl_Obj, so
+ * repeated calls dispatch without comparing strings. instanceCommand may
+ * be NULL; if not, it is called for subcommands not in the table. */
+extern int  DLLEXPORT registerNewTypeMethods(Tcl_Interp *interp, const char *type_name,
+		CreateObjFunc createObjFunc, const cObjMethod *methods,
+		InstanceCommandFunc instanceCommand, cObjType **typePtrPtr);
+/* look up the descriptor of an already registered type */
+extern int  DLLEXPORT cObjGetType(Tcl_Interp *interp, const char *type_name,
+		cObjType **typePtrPtr);
+
+
+/* Hand the object named by handleObj over to another interpreter without
+ * copying its payload, as "cobj transfer" does. The target is
+ * targetInterp if not NULL, which must belong to the current thread;
+ * otherwise the first interpreter using cobj on targetThread, where the
+ * object is registered when the thread next services its event queue
+ * (before anything queued after the transfer). Either way the object's
+ * name in the target is returned right away in *namePtr, with a zero
+ * refcount. Only objects owned by their name alone can be transferred,
+ * i.e. not autofree, shared or retained ones, and their type must be
+ * registered in the target. An object still on its way when the last
+ * interpreter using cobj on targetThread is deleted, or the thread
+ * exits, is freed on that thread. */
+extern int  DLLEXPORT cObjTransfer(Tcl_Interp *interp, Tcl_Obj *CONST handleObj,
+		Tcl_Interp *targetInterp, Tcl_ThreadId targetThread, Tcl_Obj **namePtr);
+
+/* report the occupancy of the object pool of an interpreter */
+extern int  DLLEXPORT cObjGetPoolInfo(Tcl_Interp *interp, cObjPoolInfo *infoPtr);
+
+/* The memory used by the registered objects of a type, or of all types
+ * if type_name is NULL, as "cobj memory" reports it. The totals are kept
+ * as objects are registered and unregistered, so this costs nothing
+ * whatever the number of objects. Sizes come from the sizeFunc of each
+ * type, objects of types without one count as 0 bytes. */
+typedef struct cObjMemoryInfo {
+	long objects;
+	uint64_t bytes;
+} cObjMemoryInfo;
+extern int  DLLEXPORT cObjGetMemoryInfo(Tcl_Interp *interp, const char *type_name,
+		cObjMemoryInfo *infoPtr);
+/* Ask the sizeFunc again for the size of a registered object, after its
+ * payload grew or shrank. The size is otherwise taken once, when the
+ * object is created. */
+extern void DLLEXPORT cObjUpdateSize(cObj *oPtr);
+
+/* Storage for the payload of oPtr inside its own block, for a create proc
+ * that constructs the payload in place to save an allocation. The
+ * deleteFunc then only destroys the payload; the storage goes with the
+ * cObj. Such objects can't be transferred.
+ *
+ * Results:
+ *  size bytes aligned for any type, or NULL if oPtr has no room for them
+ *  (it was not made by "cobj create", or its type is
+ *  COBJ_TYPE_ASYNC_DELETE), in which case the payload goes on the heap.
+ */
+extern void DLLEXPORT *cObjInlineStorage(cObj *oPtr, size_t size);
 
+/* Counters of the background thread running the deleteFuncs of
+ * COBJ_TYPE_ASYNC_DELETE types. The thread is shared by all interpreters. */
+typedef struct cObjReclaimInfo {
+	long pending; /* queued or running */
+	long done; /* completed since startup */
+} cObjReclaimInfo;
+extern void DLLEXPORT cObjGetReclaimInfo(cObjReclaimInfo *infoPtr);
+/* wait until all queued deleteFuncs have run, as "cobj flush" does */
+extern void DLLEXPORT cObjReclaimFlush(void);
 
 /* Hash a string to an integer using the FNV1a Hashing algorithm */
 extern uint64_t  DLLEXPORT FNV1aHash(const char *str, int maxlen);
@@ -24,58 +24,117 @@
 #ifndef HELP_WRAPPER_H
 #define HELP_WRAPPER_H
 
+#include <cassert>
+#include <cstddef>
+#include <exception>
+#include <initializer_list>
+#include <new>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include "cobj_state.h"
 
-// Base wrapper class, just contains a pointer
+// Compile-time FNV-1a hash of a type name. Gives the same value as
+// TYPEHASH(str,-1), so it can be compared directly against cObj::type_hash
+// or passed to getcObjFromObjHash() without hashing at run time.
+constexpr uint64_t typeHash(const char* str,
+        uint64_t hash = 14695981039346656037ULL) {
+    return *str == '\0' ? hash
+        : typeHash(str + 1, (hash ^ (uint64_t)(*str)) * 1099511628211ULL);
+}
+
+// Ties a C++ class to the name of the cObj type whose objects are exactly
+// of that class, e.g. at namespace scope
+//   COBJ_TYPE_ID(Image, "img");
+// Downcasts to a class with an id compare cObj::type_hash against the
+// compile-time hash of the name and then static_cast, instead of walking
+// RTTI. Unlike dynamic_cast, objects of further derived classes registered
+// under other names do not match. Define COBJ_CHECKED_CASTS to have every
+// such cast verified against dynamic_cast as well.
 template<typename T>
-struct wrapper {
-    T* ptr;
+struct cObjTypeId;
+
+#define COBJ_TYPE_ID(T, NAME) \
+    template<> struct cObjTypeId<T> { \
+        static constexpr const char* name() { return NAME; } \
+        static constexpr uint64_t hash() { return typeHash(NAME); } \
+    }
+
+template<typename U>
+struct hasTypeId {
+    template<typename V> static std::true_type test(decltype(cObjTypeId<V>::hash())*);
+    template<typename V> static std::false_type test(...);
+    static constexpr bool value = decltype(test<U>(nullptr))::value;
 };
 
-// Makes a wrapper around an instance
+// Casts ptr, the instance held by obj, down to U
+template<typename T, typename U>
+U* downcast(const cObj* obj, T* ptr, std::true_type) {
+    U* res = obj->type_hash == cObjTypeId<U>::hash() ? static_cast<U*>(ptr) : nullptr;
+#ifdef COBJ_CHECKED_CASTS
+    assert(res == nullptr || res == dynamic_cast<U*>(ptr));
+#endif
+    return res;
+}
+
+template<typename T, typename U>
+U* downcast(const cObj*, T* ptr, std::false_type) {
+    return dynamic_cast<U*>(ptr);
+}
+
+template<typename T, typename U>
+U* downcast(const cObj* obj, T* ptr) {
+    return downcast<T, U>(obj, ptr, std::integral_constant<bool, hasTypeId<U>::value>());
+}
+
+// Objects are stored in cObj::object as a plain pointer to the instance,
+// so that getting at them is a single load. This used to go through a
+// heap-allocated wrapper; makeWrapper() is kept for code storing objects
+// it created itself, and now returns the pointer as is.
 template<typename T>
-wrapper<T>* makeWrapper(T* ptr) {
-    wrapper<T>* wpr = new wrapper<T>;
-    wpr->ptr = ptr;
-    return wpr;
+T* makeWrapper(T* ptr) {
+    return ptr;
 }
 
-// Makes a wrapper around an instance of a child class
+// Stores an instance of a child class, as a T*
 template<typename T, typename U>
-wrapper<T>* makeWrapper(U* ptr) {
-    wrapper<T>* wpr = new wrapper<T>;
-    wpr->ptr = static_cast<T*>(ptr);
-    return wpr;
+T* makeWrapper(U* ptr) {
+    return static_cast<T*>(ptr);
 }
 
-// Gets the instance from a wrapper stored in cObj-compliant ClientData
+// Gets the instance stored in a cObj
 template<typename T>
 T* getFrom(cObj* cdata) {
-    wrapper<T>* wpr = reinterpret_cast<wrapper<T>*>(cdata->object);
-    return wpr->ptr;
+    return static_cast<T*>(cdata->object);
 }
 
-// Gets the instance as a child class
+// Gets the instance as a child class, see COBJ_TYPE_ID
 template<typename T, typename U>
 U* getFrom(cObj* cdata) {
-    wrapper<T>* wpr = reinterpret_cast<wrapper<T>*>(cdata->object);
-    return dynamic_cast<U*>(wpr->ptr);
+    return downcast<T, U>(cdata, static_cast<T*>(cdata->object));
 }
 
-// Gets the instance from a wrapper stored in cObj-compliant ClientData
+// Gets the instance from the ClientData of an instance command
 template<typename T>
 T* getFrom(ClientData data) {
-    ObjCmdClientData* cdata = (ObjCmdClientData*)data;
-    wrapper<T>* wpr = reinterpret_cast<wrapper<T>*>(cdata->mSelf->object);
-    return wpr->ptr;
+    return static_cast<T*>(((ObjCmdClientData*)data)->mSelf->object);
 }
 
-// Gets the instance as a child class
+// Gets the instance as a child class, see COBJ_TYPE_ID
 template<typename T, typename U>
 U* getFrom(ClientData data) {
-    ObjCmdClientData* cdata = (ObjCmdClientData*)data;
-    wrapper<T>* wpr = reinterpret_cast<wrapper<T>*>(cdata->mSelf->object);
-    return dynamic_cast<U*>(wpr->ptr);
+    cObj* obj = ((ObjCmdClientData*)data)->mSelf;
+    return downcast<T, U>(obj, static_cast<T*>(obj->object));
+}
+
+// Adapts a member function of a wrapped type to a subcommand handler, for
+// the cObjMethod tables passed to registerNewTypeMethods(), e.g.
+//   { "resize", method<Image, &Image::resize> }
+template<typename T, int (T::*M)(Tcl_Interp*, int, Tcl_Obj* CONST[])>
+int method(ClientData data, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
+    return (getFrom<T>(data)->*M)(interp, objc, objv);
 }
 
 // Handy deleter lambda
@@ -85,4 +144,304 @@ deleterFunc deleter() {
     return [](void* ptr) { delete (T*)ptr; };
 }
 
+// Same for instances constructed in the block of their cObj, whose
+// storage goes with the cObj
+template<typename T>
+deleterFunc destroyer() {
+    return [](void* ptr) { ((T*)ptr)->~T(); };
+}
+
+// Constructs a U from args and stores it as a T*, along with the matching
+// deleteFunc. The instance is constructed in the block of the cObj when it
+// fits (see cObjInlineStorage()), on the heap otherwise. Meant for create
+// procs:
+//   emplace<Image>((cObj*)vo, width, height);
+// With U other than T, T needs a virtual destructor.
+template<typename T, typename U, typename... Args>
+U* emplaceAs(cObj* obj, Args&&... args) {
+    void* mem = sizeof(U) <= COBJ_INLINE_SIZE && alignof(U) <= alignof(std::max_align_t)
+        ? cObjInlineStorage(obj, sizeof(U)) : NULL;
+    U* ptr;
+    if (mem != NULL) {
+        ptr = new (mem) U(std::forward<Args>(args)...);
+        obj->deleteFunc = destroyer<T>();
+    } else {
+        ptr = new U(std::forward<Args>(args)...);
+        obj->deleteFunc = deleter<T>();
+    }
+    obj->object = static_cast<T*>(ptr);
+    return ptr;
+}
+
+// Constructs a T in place, read back with getFrom<T>()
+template<typename T, typename... Args>
+T* emplace(cObj* obj, Args&&... args) {
+    return emplaceAs<T, T>(obj, std::forward<Args>(args)...);
+}
+
+// Conversion of subcommand arguments and results, used by registerType().
+// Specialize tclArg<A> and tclResult<R> to support further types: get()
+// returns a standard Tcl result, name is used in usage messages.
+template<typename A>
+struct tclArg;
+
+template<> struct tclArg<int> {
+    static constexpr const char* name = "int";
+    static int get(Tcl_Interp* interp, Tcl_Obj* obj, int& out) {
+        return Tcl_GetIntFromObj(interp, obj, &out);
+    }
+};
+
+template<> struct tclArg<long> {
+    static constexpr const char* name = "int";
+    static int get(Tcl_Interp* interp, Tcl_Obj* obj, long& out) {
+        return Tcl_GetLongFromObj(interp, obj, &out);
+    }
+};
+
+template<> struct tclArg<Tcl_WideInt> {
+    static constexpr const char* name = "int";
+    static int get(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_WideInt& out) {
+        return Tcl_GetWideIntFromObj(interp, obj, &out);
+    }
+};
+
+template<> struct tclArg<double> {
+    static constexpr const char* name = "double";
+    static int get(Tcl_Interp* interp, Tcl_Obj* obj, double& out) {
+        return Tcl_GetDoubleFromObj(interp, obj, &out);
+    }
+};
+
+template<> struct tclArg<float> {
+    static constexpr const char* name = "double";
+    static int get(Tcl_Interp* interp, Tcl_Obj* obj, float& out) {
+        double d;
+        if (Tcl_GetDoubleFromObj(interp, obj, &d) != TCL_OK) return TCL_ERROR;
+        out = (float)d;
+        return TCL_OK;
+    }
+};
+
+template<> struct tclArg<bool> {
+    static constexpr const char* name = "boolean";
+    static int get(Tcl_Interp* interp, Tcl_Obj* obj, bool& out) {
+        int b;
+        if (Tcl_GetBooleanFromObj(interp, obj, &b) != TCL_OK) return TCL_ERROR;
+        out = b != 0;
+        return TCL_OK;
+    }
+};
+
+template<> struct tclArg<const char*> {
+    static constexpr const char* name = "string";
+    static int get(Tcl_Interp*, Tcl_Obj* obj, const char*& out) {
+        out = Tcl_GetString(obj);
+        return TCL_OK;
+    }
+};
+
+template<> struct tclArg<std::string> {
+    static constexpr const char* name = "string";
+    static int get(Tcl_Interp*, Tcl_Obj* obj, std::string& out) {
+        int len;
+        const char* str = Tcl_GetStringFromObj(obj, &len);
+        out.assign(str, len);
+        return TCL_OK;
+    }
+};
+
+template<> struct tclArg<Tcl_Obj*> {
+    static constexpr const char* name = "value";
+    static int get(Tcl_Interp*, Tcl_Obj* obj, Tcl_Obj*& out) {
+        out = obj;
+        return TCL_OK;
+    }
+};
+
+template<typename R>
+struct tclResult;
+
+template<> struct tclResult<int> {
+    static Tcl_Obj* make(int v) { return Tcl_NewIntObj(v); }
+};
+
+template<> struct tclResult<long> {
+    static Tcl_Obj* make(long v) { return Tcl_NewLongObj(v); }
+};
+
+template<> struct tclResult<Tcl_WideInt> {
+    static Tcl_Obj* make(Tcl_WideInt v) { return Tcl_NewWideIntObj(v); }
+};
+
+template<> struct tclResult<double> {
+    static Tcl_Obj* make(double v) { return Tcl_NewDoubleObj(v); }
+};
+
+template<> struct tclResult<float> {
+    static Tcl_Obj* make(float v) { return Tcl_NewDoubleObj(v); }
+};
+
+template<> struct tclResult<bool> {
+    static Tcl_Obj* make(bool v) { return Tcl_NewBooleanObj(v); }
+};
+
+template<> struct tclResult<const char*> {
+    static Tcl_Obj* make(const char* v) { return Tcl_NewStringObj(v, -1); }
+};
+
+template<> struct tclResult<std::string> {
+    static Tcl_Obj* make(const std::string& v) { return Tcl_NewStringObj(v.data(), (int)v.size()); }
+};
+
+template<> struct tclResult<Tcl_Obj*> {
+    static Tcl_Obj* make(Tcl_Obj* v) { return v; }
+};
+
+// Implementation details of registerType()
+namespace cobj_detail {
+
+template<std::size_t... I> struct indices {};
+template<std::size_t N, std::size_t... I>
+struct makeIndices : makeIndices<N - 1, N - 1, I...> {};
+template<std::size_t... I>
+struct makeIndices<0, I...> { typedef indices<I...> type; };
+
+template<typename A>
+using argType = typename std::decay<A>::type;
+
+// Converts objv[first...] into the tuple, stopping at the first error
+template<typename Tuple, std::size_t... I>
+int getArgs(Tcl_Interp* interp, Tcl_Obj* CONST objv[], int first, Tuple& args, indices<I...>) {
+    int result = TCL_OK;
+    int unused[] = { 0, (result = result != TCL_OK ? result
+            : tclArg<typename std::tuple_element<I, Tuple>::type>::get(
+                interp, objv[first + I], std::get<I>(args)))... };
+    (void)unused;
+    (void)interp; (void)objv; (void)first; (void)args; // no arguments at all
+    return result;
+}
+
+template<typename... A>
+int wrongArgs(Tcl_Interp* interp, int skip, Tcl_Obj* CONST objv[]) {
+    const char* names[] = { "", tclArg<argType<A>>::name... };
+    std::string usage;
+    for (std::size_t i = 1; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (i > 1) usage += ' ';
+        usage += names[i];
+    }
+    Tcl_WrongNumArgs(interp, skip, objv, usage.empty() ? NULL : usage.c_str());
+    return TCL_ERROR;
+}
+
+// Calls a member function and stores its result, if any
+template<typename R>
+struct invoker {
+    template<typename T, typename F, typename Tuple, std::size_t... I>
+    static void call(Tcl_Interp* interp, T* obj, F m, Tuple& args, indices<I...>) {
+        Tcl_SetObjResult(interp, tclResult<argType<R>>::make((obj->*m)(std::get<I>(args)...)));
+    }
+};
+
+template<>
+struct invoker<void> {
+    template<typename T, typename F, typename Tuple, std::size_t... I>
+    static void call(Tcl_Interp*, T* obj, F m, Tuple& args, indices<I...>) {
+        (obj->*m)(std::get<I>(args)...);
+    }
+};
+
+template<typename T, typename R, typename F, typename... A>
+int callMethod(F m, ClientData data, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
+    std::tuple<argType<A>...> args;
+    if (objc != 2 + (int)sizeof...(A)) return wrongArgs<A...>(interp, 2, objv);
+    if (getArgs(interp, objv, 2, args, typename makeIndices<sizeof...(A)>::type()) != TCL_OK)
+        return TCL_ERROR;
+    try {
+        invoker<R>::call(interp, getFrom<T>(data), m, args,
+                typename makeIndices<sizeof...(A)>::type());
+    } catch (const std::exception& e) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(e.what(), -1));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+template<typename T, typename F, F M>
+struct methodThunk;
+
+template<typename T, typename R, typename... A, R (T::*M)(A...)>
+struct methodThunk<T, R (T::*)(A...), M> {
+    static int call(ClientData data, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
+        return callMethod<T, R, R (T::*)(A...), A...>(M, data, interp, objc, objv);
+    }
+};
+
+template<typename T, typename R, typename... A, R (T::*M)(A...) const>
+struct methodThunk<T, R (T::*)(A...) const, M> {
+    static int call(ClientData data, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
+        return callMethod<T, R, R (T::*)(A...) const, A...>(M, data, interp, objc, objv);
+    }
+};
+
+template<typename T, typename Tuple, std::size_t... I>
+void construct(cObj* obj, Tuple& args, indices<I...>) {
+    emplace<T>(obj, std::get<I>(args)...);
+}
+
+template<typename T, typename... A>
+int create(ClientData, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[], void* vobj) {
+    std::tuple<argType<A>...> args;
+    if (objc != 3 + (int)sizeof...(A)) return wrongArgs<A...>(interp, 3, objv);
+    if (getArgs(interp, objv, 3, args, typename makeIndices<sizeof...(A)>::type()) != TCL_OK)
+        return TCL_ERROR;
+    try {
+        construct<T>((cObj*)vobj, args, typename makeIndices<sizeof...(A)>::type());
+    } catch (const std::exception& e) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(e.what(), -1));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+template<typename T>
+bool nameMatchesId(const char* name, std::true_type) {
+    return FNV1aHash(name, -1) == cObjTypeId<T>::hash();
+}
+
+template<typename T>
+bool nameMatchesId(const char*, std::false_type) {
+    return true;
+}
+
+} // namespace cobj_detail
+
+// A subcommand calling a member function of the same name, for the method
+// list of registerType(). Arguments and the result are converted with
+// tclArg and tclResult; the member function must not be overloaded.
+#define COBJ_METHOD(T, NAME) COBJ_METHOD_AS(T, NAME, #NAME)
+#define COBJ_METHOD_AS(T, NAME, SUBCMD) \
+    cObjMethod{ SUBCMD, &cobj_detail::methodThunk<T, decltype(&T::NAME), &T::NAME>::call }
+
+// Registers T as an object type. "cobj create name args..." constructs
+// a T in place from arguments converted to CtorArgs, and the methods are
+// its subcommands:
+//   registerType<Image, int, int>(interp, "img",
+//       { COBJ_METHOD(Image, resize), COBJ_METHOD(Image, width) });
+// If T has a COBJ_TYPE_ID, it must name the same type.
+template<typename T, typename... CtorArgs>
+int registerType(Tcl_Interp* interp, const char* name,
+        std::initializer_list<cObjMethod> methods, cObjType** typePtrPtr = NULL) {
+    std::vector<cObjMethod> table(methods);
+    if (!cobj_detail::nameMatchesId<T>(name,
+            std::integral_constant<bool, hasTypeId<T>::value>())) {
+        Tcl_AppendResult(interp, "type `", name,
+                "' does not match the COBJ_TYPE_ID of its class\n", NULL);
+        return TCL_ERROR;
+    }
+    table.push_back(cObjMethod{ NULL, NULL });
+    return registerNewTypeMethods(interp, name, cobj_detail::create<T, CtorArgs...>,
+            table.data(), NULL, typePtrPtr);
+}
+
 #endif
@@ -28,43 +28,427 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 #include <tcl.h>
 #include "variable_state.h"
 
 #ifdef WIN32
 #define snprintf _snprintf
+#else
+#include <unistd.h>
 #endif
 
+/* A process-wide registry, shared by the states of several interpreters
+ * (its views), possibly on different threads. The variables are spread
+ * over VAR_SHARDS interpreter-less states by a hash of their name, each
+ * guarded by its own mutex, and the shard is kept in the top bits of the
+ * slot part of their handles. The root is another interpreter-less state,
+ * holding what the layer on top keeps per registry; it is guarded by lock.
+ * Views run their public functions against the shards, so StateManagerCmd
+ * works unchanged as a view of the whole registry. */
+#define VAR_SHARD_BITS 4
+#define VAR_SHARDS (1<<VAR_SHARD_BITS)
+#define VAR_SHARD_SHIFT (32-VAR_SHARD_BITS)
+#define VAR_SHARD_OF(h) ((int)(((h)&0xffffffffU)>>VAR_SHARD_SHIFT))
+#define VAR_SHARDED(h,shard) ((h)|((VarHandle)(shard)<<VAR_SHARD_SHIFT))
+#define VAR_UNSHARDED(h) ((h)&~((VarHandle)(VAR_SHARDS-1)<<VAR_SHARD_SHIFT))
+
+struct VarShared {
+	char *key;
+	StateManager_t shards[VAR_SHARDS];
+	Tcl_Mutex shard_locks[VAR_SHARDS];
+	StateManager_t root;
+	Tcl_Mutex lock; /* the root */
+	Tcl_Mutex uid_lock;
+	unsigned long uid; /* next id handed out by varUniqName() */
+	int users; /* the number of views, under sharedListMutex */
+	int draining; /* the last view is deleting the variables, ditto */
+	Tcl_ThreadId drainer; /* the thread doing so */
+	struct VarShared *next;
+};
+
+TCL_DECLARE_MUTEX(sharedListMutex)
+static Tcl_Condition sharedDrained; /* some registry stopped draining */
+static struct VarShared *sharedList=NULL;
+
+/* the shard holding the variable of that name */
+static int varNameShard(const char *name)
+{
+	unsigned int h=2166136261U;
+	while (*name!='\0') h=(h^(unsigned char)*name++)*16777619U;
+	return (int)((h^(h>>16))&(VAR_SHARDS-1));
+}
+
+#define SHARD_LOCK(sh,i) Tcl_MutexLock(&(sh)->shard_locks[i])
+#define SHARD_UNLOCK(sh,i) Tcl_MutexUnlock(&(sh)->shard_locks[i])
+
+/* the final release of a state, once nothing holds a Tcl_Preserve()
+ * reference to it any more */
+static void StateManagerFree(char *ptr)
+{
+	StateManager_t state=(StateManager_t)ptr;
+	if (state->extFreeProc!=NULL) state->extFreeProc((char*)state->ext);
+	ckfree((char*)state);
+}
+
+static void varTypeIndexFree(StateManager_t statePtr)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *entryPtr=NULL;
+	VarTypeIndex *ti=NULL;
+	for (entryPtr=Tcl_FirstHashEntry(&statePtr->type_index,&search);
+			entryPtr!=NULL;entryPtr=Tcl_NextHashEntry(&search)) {
+		ti=(VarTypeIndex*)Tcl_GetHashValue(entryPtr);
+		ckfree((char*)ti->slots);
+		ckfree((char*)ti);
+	}
+	Tcl_DeleteHashTable(&statePtr->type_index);
+	statePtr->last_type=NULL;
+}
+
+/* a varForEachFunction running the deleteProc of the state */
+static int varTeardownDelete(ClientData element, ClientData clientData)
+{
+	((StateManager_t)clientData)->deleteProc(element);
+	return TCL_OK;
+}
+
+static int varDeleteTaken(StateManager_t statePtr, const char *pattern,
+		varTypeKeyFunction typeKeyProc, uint64_t key,
+		varDeleteCheckFunction checkProc);
+
+/* stop being a view of the shared registry; the last view deletes the
+ * variables left in it. The registry itself stays for the next state to
+ * share, as other threads may still be releasing elements into it.
+ * The deleteProcs run without sharedListMutex; states attaching from
+ * other threads meanwhile wait until the registry is empty. */
+static void varDetachShared(StateManager_t statePtr)
+{
+	struct VarShared *sh=statePtr->shared;
+	int last;
+	Tcl_MutexLock(&sharedListMutex);
+	last=(--sh->users==0);
+	if (last) {
+		sh->draining=1;
+		sh->drainer=Tcl_GetCurrentThread();
+	}
+	Tcl_MutexUnlock(&sharedListMutex);
+	if (last) {
+		varDeleteTaken(statePtr,NULL,NULL,0,NULL);
+		Tcl_MutexLock(&sharedListMutex);
+		sh->draining=0;
+		Tcl_ConditionNotify(&sharedDrained);
+		Tcl_MutexUnlock(&sharedListMutex);
+	}
+	statePtr->shared=NULL;
+	statePtr->root=statePtr;
+}
+
 /* this is called when the command associated with a state is destroyed.
- * The hash table is walked, destroying all variables as
- * you go, and then the HashTable itself is freed */
+ * The variables are walked once, destroying them as
+ * you go, and then the registry itself and the type registry are freed.
+ * With teardown_threads other than 1, the variables teardownProc accepts
+ * are set aside in that walk and deleted by varParallelApply() once the
+ * others are gone, before the types go.
+ * The state structure is released with Tcl_EventuallyFree(), since
+ * cached handles (see cobj_state.c) may still hold a Tcl_Preserve()
+ * reference to it. The variables of a shared registry go with its last
+ * view, see varDetachShared(). */
 void StateManagerDeleteProc(ClientData clientData) {
-	Tcl_HashEntry *entryPtr;
-	Tcl_HashSearch search;
-	void *iPtr=NULL;
+	int i, num_later=0;
+	ClientData *later=NULL;
 	StateManager_t state=(StateManager_t)clientData;
 	if (state==NULL) return;
-	if (state->deleteProc==NULL) return;
+	if (state->shared!=NULL && state->root!=state) varDetachShared(state);
 
-	entryPtr=Tcl_FirstHashEntry(&state->hash,&search);
-	while (entryPtr!=NULL) {
-		iPtr=Tcl_GetHashValue(entryPtr);
-		state->deleteProc(iPtr);
-		Tcl_DeleteHashEntry(entryPtr);
-		/* get the first entry again, not the next one, since
-		 * the previous first one is now deleted. */
-		entryPtr=Tcl_FirstHashEntry(&state->hash,&search);
+	/* walk the dense entries once, and drop the tables as a whole */
+	if (state->deleteProc!=NULL) {
+		if (state->teardown_threads!=1 && state->teardownProc!=NULL
+				&& state->num_entries>1) {
+			later=(ClientData*)ckalloc(state->num_entries*sizeof(ClientData));
+		}
+		for (i=0;i<state->num_entries;i++) {
+			if (later!=NULL && state->teardownProc(state->entries[i].data)) {
+				later[num_later++]=state->entries[i].data;
+				continue;
+			}
+			state->deleteProc(state->entries[i].data);
+		}
+		if (later!=NULL) {
+			varParallelApply(later,num_later,varTeardownDelete,(ClientData)state,
+					state->teardown_threads);
+			ckfree((char*)later);
+		}
 	}
-	ckfree((char*)state);
+	Tcl_DeleteHashTable(&state->hash);
+	ckfree((char*)state->entries);
+	ckfree((char*)state->slots);
+	state->entries=NULL;
+	state->slots=NULL;
+	state->num_entries=state->num_slots=0;
+	state->max_entries=state->max_slots=0;
+	varTypeIndexFree(state);
+
+	/* each type descriptor is a single block */
+	for (i=0;i<state->num_reg_types;i++) {
+		ckfree((char*)state->reg_types[i]);
+	}
+	ckfree((char*)state->reg_types);
+	Tcl_DeleteHashTable(&state->type_table);
+	ckfree(state->prefix);
+
+	/* don't leave a dangling pointer behind in the interpreter */
+	if (state->interp!=NULL
+			&& Tcl_GetAssocData(state->interp,state->key,NULL)==(ClientData)state)
+		Tcl_DeleteAssocData(state->interp,state->key);
+	ckfree(state->key);
+
+	/* invalidate any cached handles */
+	state->interp=NULL;
+	Tcl_EventuallyFree((ClientData)state,StateManagerFree);
 	return;
 }
 
+/* the index of the variables with type key, created if asked to */
+static VarTypeIndex *varTypeIndex(StateManager_t statePtr, uint64_t key,
+		int create)
+{
+	Tcl_HashEntry *entryPtr=NULL;
+	VarTypeIndex *ti=statePtr->last_type;
+	int isNew;
+	if (ti!=NULL && ti->key==key) return ti;
+	if (create) {
+		entryPtr=Tcl_CreateHashEntry(&statePtr->type_index,
+				(char*)(uintptr_t)key,&isNew);
+		if (isNew) {
+			ti=(VarTypeIndex*)ckalloc(sizeof(VarTypeIndex));
+			ti->key=key;
+			ti->slots=NULL;
+			ti->num_slots=ti->max_slots=0;
+			Tcl_SetHashValue(entryPtr,(ClientData)ti);
+		}
+	} else {
+		entryPtr=Tcl_FindHashEntry(&statePtr->type_index,(char*)(uintptr_t)key);
+		if (entryPtr==NULL) return NULL;
+	}
+	ti=(VarTypeIndex*)Tcl_GetHashValue(entryPtr);
+	statePtr->last_type=ti;
+	return ti;
+}
+
+static void varTypeIndexAdd(StateManager_t statePtr, VarEntry *e)
+{
+	VarTypeIndex *ti=varTypeIndex(statePtr,statePtr->typeKeyProc(e->data),1);
+	if (ti->num_slots==ti->max_slots) {
+		ti->max_slots=ti->max_slots ? 2*ti->max_slots : 16;
+		ti->slots=(int*)ckrealloc((char*)ti->slots,ti->max_slots*sizeof(int));
+	}
+	e->type_index=ti;
+	e->type_pos=ti->num_slots;
+	ti->slots[ti->num_slots++]=e->slot;
+}
+
+/* the last slot of the index moves into the hole */
+static void varTypeIndexRemove(StateManager_t statePtr, VarEntry *e)
+{
+	VarTypeIndex *ti=e->type_index;
+	int moved=ti->slots[--ti->num_slots];
+	if (e->type_pos!=ti->num_slots) {
+		ti->slots[e->type_pos]=moved;
+		statePtr->entries[statePtr->slots[moved].index].type_pos=e->type_pos;
+	}
+}
+
+/* Take a free slot (or grow the slot array) and append a dense entry
+ * for data. Returns the slot index. */
+static int varSlotAlloc(StateManager_t statePtr, ClientData data,
+		Tcl_HashEntry *hPtr)
+{
+	int slot;
+	VarEntry *e;
+	if (statePtr->free_slot>=0) {
+		slot=statePtr->free_slot;
+		statePtr->free_slot=statePtr->slots[slot].index;
+	} else {
+		if (statePtr->num_slots==statePtr->max_slots) {
+			statePtr->max_slots=statePtr->max_slots ? 2*statePtr->max_slots : 16;
+			statePtr->slots=(VarSlot*)ckrealloc((char*)statePtr->slots,
+					statePtr->max_slots*sizeof(VarSlot));
+		}
+		slot=statePtr->num_slots++;
+		statePtr->slots[slot].gen=0;
+	}
+	if (statePtr->num_entries==statePtr->max_entries) {
+		statePtr->max_entries=statePtr->max_entries ? 2*statePtr->max_entries : 16;
+		statePtr->entries=(VarEntry*)ckrealloc((char*)statePtr->entries,
+				statePtr->max_entries*sizeof(VarEntry));
+	}
+	e=&statePtr->entries[statePtr->num_entries];
+	e->data=data;
+	e->hPtr=hPtr;
+	e->slot=slot;
+	statePtr->slots[slot].index=statePtr->num_entries++;
+	e->type_index=NULL;
+	if (statePtr->typeKeyProc!=NULL) varTypeIndexAdd(statePtr,e);
+	return slot;
+}
+
+/* Release a slot: the last dense entry is moved into the hole so that
+ * entries[] stays contiguous, and the slot generation is bumped so that
+ * outstanding handles to it go stale. */
+static void varSlotFree(StateManager_t statePtr, int slot)
+{
+	int i=statePtr->slots[slot].index;
+	int last;
+	if (statePtr->entries[i].type_index!=NULL)
+		varTypeIndexRemove(statePtr,&statePtr->entries[i]);
+	last=--statePtr->num_entries;
+	if (i!=last) {
+		statePtr->entries[i]=statePtr->entries[last];
+		statePtr->slots[statePtr->entries[i].slot].index=i;
+	}
+	statePtr->slots[slot].gen++;
+	statePtr->slots[slot].index=statePtr->free_slot;
+	statePtr->free_slot=slot;
+}
+
+int varReserve(StateManager_t statePtr, int count)
+{
+	struct VarShared *sh=NULL;
+	int need, i;
+	if (statePtr==NULL || count<0) return TCL_ERROR;
+	if ((sh=statePtr->shared)!=NULL) {
+		/* names spread evenly over the shards */
+		for (i=0;i<VAR_SHARDS;i++) {
+			SHARD_LOCK(sh,i);
+			varReserve(sh->shards[i],count/VAR_SHARDS+1);
+			SHARD_UNLOCK(sh,i);
+		}
+		return TCL_OK;
+	}
+	need=statePtr->num_entries+count;
+	if (need>statePtr->max_entries) {
+		statePtr->max_entries=need;
+		statePtr->entries=(VarEntry*)ckrealloc((char*)statePtr->entries,
+				statePtr->max_entries*sizeof(VarEntry));
+	}
+	/* free slots are reused before the slot array grows, so this many
+	 * slots always suffice */
+	if (need>statePtr->max_slots) {
+		statePtr->max_slots=need;
+		statePtr->slots=(VarSlot*)ckrealloc((char*)statePtr->slots,
+				statePtr->max_slots*sizeof(VarSlot));
+	}
+	return TCL_OK;
+}
+
+#define SLOT_OF(entryPtr) ((int)(intptr_t)Tcl_GetHashValue(entryPtr))
+#define ENTRY_OF(statePtr,entryPtr) \
+	(&(statePtr)->entries[(statePtr)->slots[SLOT_OF(entryPtr)].index])
+
+int varHandleFromName(StateManager_t statePtr, const char *name,
+		VarHandle *handlePtr)
+{
+	Tcl_HashEntry *entryPtr=NULL;
+	struct VarShared *sh=NULL;
+	int slot, found;
+	if (name==NULL) return 0;
+	if ((sh=statePtr->shared)!=NULL) {
+		slot=varNameShard(name);
+		SHARD_LOCK(sh,slot);
+		found=varHandleFromName(sh->shards[slot],name,handlePtr);
+		SHARD_UNLOCK(sh,slot);
+		if (found) *handlePtr=VAR_SHARDED(*handlePtr,slot);
+		return found;
+	}
+	entryPtr=Tcl_FindHashEntry(&statePtr->hash,name);
+	if (entryPtr==NULL) return 0;
+	slot=SLOT_OF(entryPtr);
+	*handlePtr=VAR_HANDLE(slot,statePtr->slots[slot].gen);
+	return 1;
+}
+
+ClientData varGetFromHandle(StateManager_t statePtr, VarHandle handle)
+{
+	int slot=VAR_HANDLE_SLOT(handle);
+	if (statePtr->shared!=NULL) return varAcquireFromHandle(statePtr,handle,NULL);
+	if (slot>=statePtr->num_slots
+			|| statePtr->slots[slot].gen!=VAR_HANDLE_GEN(handle)) return NULL;
+	return statePtr->entries[statePtr->slots[slot].index].data;
+}
+
+ClientData varAcquireFromHandle(StateManager_t statePtr, VarHandle handle,
+		varAcquireFunction acquireProc)
+{
+	struct VarShared *sh=statePtr->shared;
+	ClientData data=NULL;
+	int shard;
+	if (sh==NULL) {
+		data=varGetFromHandle(statePtr,handle);
+		if (data!=NULL && acquireProc!=NULL && !acquireProc(data)) return NULL;
+		return data;
+	}
+	shard=VAR_SHARD_OF(handle);
+	SHARD_LOCK(sh,shard);
+	data=varAcquireFromHandle(sh->shards[shard],VAR_UNSHARDED(handle),acquireProc);
+	SHARD_UNLOCK(sh,shard);
+	return data;
+}
+
+const char *varNameFromHandle(StateManager_t statePtr, VarHandle handle)
+{
+	struct VarShared *sh=statePtr->shared;
+	const char *name=NULL;
+	int slot=VAR_HANDLE_SLOT(handle);
+	if (sh!=NULL) {
+		slot=VAR_SHARD_OF(handle);
+		SHARD_LOCK(sh,slot);
+		name=varNameFromHandle(sh->shards[slot],VAR_UNSHARDED(handle));
+		SHARD_UNLOCK(sh,slot);
+		return name;
+	}
+	if (slot>=statePtr->num_slots
+			|| statePtr->slots[slot].gen!=VAR_HANDLE_GEN(handle)) return NULL;
+	return Tcl_GetHashKey(&statePtr->hash,
+			statePtr->entries[statePtr->slots[slot].index].hPtr);
+}
+
+ClientData varUnregisterHandle(StateManager_t statePtr, VarHandle handle)
+{
+	struct VarShared *sh=statePtr->shared;
+	ClientData data=NULL;
+	VarEntry *e;
+	int shard;
+	if (sh!=NULL) {
+		shard=VAR_SHARD_OF(handle);
+		SHARD_LOCK(sh,shard);
+		data=varUnregisterHandle(sh->shards[shard],VAR_UNSHARDED(handle));
+		SHARD_UNLOCK(sh,shard);
+		return data;
+	}
+	data=varGetFromHandle(statePtr,handle);
+	if (data==NULL) return NULL;
+	e=&statePtr->entries[statePtr->slots[VAR_HANDLE_SLOT(handle)].index];
+	Tcl_DeleteHashEntry(e->hPtr);
+	varSlotFree(statePtr,VAR_HANDLE_SLOT(handle));
+	return data;
+}
+
 int varExists0(StateManager_t statePtr,
 		char *name)
 {
 	Tcl_HashEntry *entryPtr=NULL;
+	struct VarShared *sh=statePtr->shared;
+	int shard, found;
 	if (name==NULL) return 0;
+	if (sh!=NULL) {
+		shard=varNameShard(name);
+		SHARD_LOCK(sh,shard);
+		found=varExists0(sh->shards[shard],name);
+		SHARD_UNLOCK(sh,shard);
+		return found;
+	}
 	entryPtr=Tcl_FindHashEntry(&statePtr->hash,name);
 	if (entryPtr==NULL) return 0;
 	return 1;
@@ -83,39 +467,64 @@ int varExistsTcl(Tcl_Interp *interp,
 	return TCL_OK;
 }
 
+/* append the names of the variables of a (private) state to a list */
+static void varAppendNames(StateManager_t statePtr, Tcl_Obj *listPtr)
+{
+	char *name;
+	int i;
+	for (i=0;i<statePtr->num_entries;i++) {
+		name=Tcl_GetHashKey(&statePtr->hash,statePtr->entries[i].hPtr);
+		Tcl_ListObjAppendElement(NULL,listPtr,Tcl_NewStringObj(name,-1));
+	}
+}
+
 int varNamesList(Tcl_Interp *interp, StateManager_t statePtr, Tcl_Obj **list)
 {   
-	Tcl_HashEntry *entryPtr;
-	Tcl_HashSearch search;
+	struct VarShared *sh=statePtr->shared;
 	Tcl_Obj *listPtr;
-	char *name;
+	int i;
 
-	/* Walk the hash table and build a list of names */
+	/* Walk the entries and build a list of names */
 	listPtr=Tcl_NewListObj(0,NULL);
-	entryPtr=Tcl_FirstHashEntry(&statePtr->hash,&search);
-	while (entryPtr!=NULL) {
-		name=Tcl_GetHashKey(&statePtr->hash,entryPtr);
-		if (Tcl_ListObjAppendElement(interp,listPtr,
-					Tcl_NewStringObj(name,-1))!=TCL_OK) return TCL_ERROR;
-		entryPtr=Tcl_NextHashEntry(&search);
+	if (sh==NULL) {
+		varAppendNames(statePtr,listPtr);
+	} else {
+		for (i=0;i<VAR_SHARDS;i++) {
+			SHARD_LOCK(sh,i);
+			varAppendNames(sh->shards[i],listPtr);
+			SHARD_UNLOCK(sh,i);
+		}
 	}
 	*list=listPtr;
 	return TCL_OK;
 }
 
-#define Tcl_HashSize(tablePtr) ((tablePtr)->numEntries)
-
 int varElements(Tcl_Interp *interp, StateManager_t statePtr, ClientData **elements, int *len)
 {
-	Tcl_HashEntry *entryPtr;
-	Tcl_HashSearch search;
-	int i;
+	struct VarShared *sh=statePtr->shared;
+	int i, j;
 	int nelements;
 	ClientData *es=NULL;
-	ClientData val=NULL;
 
+	if (sh!=NULL) {
+		/* the shards are grown into the array one at a time */
+		nelements=0;
+		for (i=0;i<VAR_SHARDS;i++) {
+			SHARD_LOCK(sh,i);
+			if (sh->shards[i]->num_entries>0) {
+				es=(ClientData*)realloc(es,
+						(nelements+sh->shards[i]->num_entries)*sizeof(ClientData));
+				for (j=0;j<sh->shards[i]->num_entries;j++)
+					es[nelements++]=sh->shards[i]->entries[j].data;
+			}
+			SHARD_UNLOCK(sh,i);
+		}
+		*elements=es;
+		*len=nelements;
+		return TCL_OK;
+	}
 
-	nelements=Tcl_HashSize(&statePtr->hash);
+	nelements=statePtr->num_entries;
 	if (nelements==0) {
 		*elements=NULL;
 		*len=0;
@@ -125,14 +534,9 @@ int varElements(Tcl_Interp *interp, StateManager_t statePtr, ClientData **elemen
 	es=(ClientData*)calloc(nelements,sizeof(ClientData));
 	*elements=es;
 
-	/* Walk the hash table and store the data */
-	entryPtr=Tcl_FirstHashEntry(&statePtr->hash,&search);
-	i=0;
-	while (entryPtr!=NULL) {
-		val=Tcl_GetHashValue(entryPtr);
-		es[i]=val;
-		entryPtr=Tcl_NextHashEntry(&search);
-		i++;
+	/* Walk the entries and store the data */
+	for (i=0;i<nelements;i++) {
+		es[i]=statePtr->entries[i].data;
 	}
 	return TCL_OK;
 }
@@ -145,18 +549,315 @@ int varNames(Tcl_Interp *interp, StateManager_t statePtr)
 	return TCL_OK;
 }
 
+/* what varForMatching() is asked to find */
+typedef struct VarMatch {
+	const char *pattern; /* NULL for any name */
+	int typed; /* only the variables with type key */
+	uint64_t key;
+	int literal; /* the pattern has no glob characters */
+	void (*proc)(StateManager_t statePtr, VarEntry *e, ClientData clientData);
+	ClientData clientData;
+} VarMatch;
+
+/* Set up a match, reporting an error if a type is asked for but the
+ * variables of the state have no types. */
+static int varMatchInit(Tcl_Interp *interp, StateManager_t statePtr,
+		VarMatch *m, const char *pattern, const char *type_name)
+{
+	m->pattern=pattern;
+	m->typed=(type_name!=NULL);
+	m->key=0;
+	m->literal=(pattern!=NULL && strpbrk(pattern,"*?[\\")==NULL);
+	if (type_name!=NULL) {
+		if (statePtr->typeKeyProc==NULL || statePtr->typeNameKeyProc==NULL) {
+			Tcl_AppendResult(interp,"variables of this state have no types",NULL);
+			return TCL_ERROR;
+		}
+		m->key=statePtr->typeNameKeyProc(type_name);
+	}
+	return TCL_OK;
+}
+
+static int varEntryMatches(StateManager_t statePtr, VarMatch *m, VarEntry *e)
+{
+	if (m->typed && statePtr->typeKeyProc(e->data)!=m->key) return 0;
+	return m->pattern==NULL
+		|| Tcl_StringMatch(Tcl_GetHashKey(&statePtr->hash,e->hPtr),m->pattern);
+}
+
+/* Call m->proc on the matching variables of a private state (or shard),
+ * which it must not change. A literal name is a single lookup, and a type
+ * is a walk of its index rather than of all the variables. */
+static void varForMatching(StateManager_t statePtr, VarMatch *m)
+{
+	Tcl_HashEntry *entryPtr=NULL;
+	VarTypeIndex *ti=NULL;
+	VarEntry *e=NULL;
+	int i;
+	if (m->literal) {
+		entryPtr=Tcl_FindHashEntry(&statePtr->hash,m->pattern);
+		if (entryPtr==NULL) return;
+		e=ENTRY_OF(statePtr,entryPtr);
+		if (varEntryMatches(statePtr,m,e)) m->proc(statePtr,e,m->clientData);
+		return;
+	}
+	if (m->typed) {
+		ti=varTypeIndex(statePtr,m->key,0);
+		if (ti==NULL) return;
+		for (i=0;i<ti->num_slots;i++) {
+			e=&statePtr->entries[statePtr->slots[ti->slots[i]].index];
+			if (m->pattern==NULL
+					|| Tcl_StringMatch(Tcl_GetHashKey(&statePtr->hash,e->hPtr),m->pattern))
+				m->proc(statePtr,e,m->clientData);
+		}
+		return;
+	}
+	for (i=0;i<statePtr->num_entries;i++) {
+		e=&statePtr->entries[i];
+		if (varEntryMatches(statePtr,m,e)) m->proc(statePtr,e,m->clientData);
+	}
+}
+
+/* run a match over a state, or all the shards of a shared registry */
+static void varMatchAll(StateManager_t statePtr, VarMatch *m)
+{
+	struct VarShared *sh=statePtr->shared;
+	int i;
+	if (sh==NULL) {
+		varForMatching(statePtr,m);
+		return;
+	}
+	if (m->literal) {
+		i=varNameShard(m->pattern);
+		SHARD_LOCK(sh,i);
+		varForMatching(sh->shards[i],m);
+		SHARD_UNLOCK(sh,i);
+		return;
+	}
+	for (i=0;i<VAR_SHARDS;i++) {
+		SHARD_LOCK(sh,i);
+		varForMatching(sh->shards[i],m);
+		SHARD_UNLOCK(sh,i);
+	}
+}
+
+static void varMatchName(StateManager_t statePtr, VarEntry *e, ClientData clientData)
+{
+	Tcl_ListObjAppendElement(NULL,(Tcl_Obj*)clientData,
+			Tcl_NewStringObj(Tcl_GetHashKey(&statePtr->hash,e->hPtr),-1));
+}
+
+int varNamesMatching(Tcl_Interp *interp, StateManager_t statePtr,
+		const char *pattern, const char *type_name, Tcl_Obj **list)
+{
+	VarMatch m;
+	if (varMatchInit(interp,statePtr,&m,pattern,type_name)!=TCL_OK) return TCL_ERROR;
+	m.proc=varMatchName;
+	m.clientData=(ClientData)Tcl_NewListObj(0,NULL);
+	varMatchAll(statePtr,&m);
+	*list=(Tcl_Obj*)m.clientData;
+	return TCL_OK;
+}
+
+/* elements collected by varElementsOfType() */
+typedef struct VarCollect {
+	ClientData *elements;
+	int len, max;
+} VarCollect;
+
+static void varMatchElement(StateManager_t statePtr, VarEntry *e, ClientData clientData)
+{
+	VarCollect *c=(VarCollect*)clientData;
+	(void)statePtr;
+	if (c->len==c->max) {
+		c->max=c->max ? 2*c->max : 16;
+		c->elements=(ClientData*)realloc(c->elements,c->max*sizeof(ClientData));
+	}
+	c->elements[c->len++]=e->data;
+}
+
+int varElementsOfType(Tcl_Interp *interp, StateManager_t statePtr,
+		const char *type_name, ClientData **elements, int *len)
+{
+	VarCollect c={NULL,0,0};
+	VarMatch m;
+	if (type_name==NULL) return varElements(interp,statePtr,elements,len);
+	if (varMatchInit(interp,statePtr,&m,NULL,type_name)!=TCL_OK) return TCL_ERROR;
+	m.proc=varMatchElement;
+	m.clientData=(ClientData)&c;
+	varMatchAll(statePtr,&m);
+	*elements=c.elements;
+	*len=c.len;
+	return TCL_OK;
+}
+
+/* A scan walks the slots in order. Slots never move, so a variable that
+ * exists for the whole scan is seen exactly once, whatever is created or
+ * deleted meanwhile; those may or may not be seen. The position is the
+ * next slot, with the shard in the upper half for a shared registry. A
+ * step looks at no more than VAR_SCAN_WORK slots per variable asked for,
+ * so long runs of free slots don't make it unbounded. */
+#define VAR_SCAN_WORK 10
+#define VAR_SCAN_POSITION(shard,slot) (((uint64_t)(shard)<<32)|(uint64_t)(slot))
+
+/* one step over a private state (or shard), starting at *slotPtr, which
+ * is set to the next slot to look at, or -1 at the end */
+static void varScanSlots(StateManager_t statePtr, int *slotPtr, int count,
+		VarMatch *m)
+{
+	VarEntry *e=NULL;
+	int slot=*slotPtr, n=0, work=0, index;
+	while (slot<statePtr->num_slots && n<count && work<VAR_SCAN_WORK*count) {
+		index=statePtr->slots[slot].index;
+		/* a free slot holds the next free slot instead */
+		if (index>=0 && index<statePtr->num_entries
+				&& statePtr->entries[index].slot==slot) {
+			e=&statePtr->entries[index];
+			if (varEntryMatches(statePtr,m,e)) {
+				m->proc(statePtr,e,m->clientData);
+				n++;
+			}
+		}
+		slot++;
+		work++;
+	}
+	*slotPtr=(slot>=statePtr->num_slots) ? -1 : slot;
+}
+
+/* the caller's function for the matches of a scan */
+typedef struct VarScanProc {
+	varScanFunction proc;
+	ClientData clientData;
+} VarScanProc;
+
+static void varMatchScan(StateManager_t statePtr, VarEntry *e, ClientData clientData)
+{
+	VarScanProc *p=(VarScanProc*)clientData;
+	p->proc(e->data,Tcl_GetHashKey(&statePtr->hash,e->hPtr),p->clientData);
+}
+
+int varScan(Tcl_Interp *interp, StateManager_t statePtr, uint64_t *positionPtr,
+		int count, const char *pattern, const char *type_name,
+		varScanFunction proc, ClientData clientData)
+{
+	struct VarShared *sh=statePtr->shared;
+	VarScanProc p;
+	VarMatch m;
+	int shard, slot;
+	char buf[TCL_INTEGER_SPACE+2];
+	/* positions come from scripts too: a slot fits in an int, and only
+	 * a shared registry has other shards than 0 */
+	if ((*positionPtr&0xffffffffU)>(uint64_t)INT_MAX
+			|| (*positionPtr>>32)>=(uint64_t)((sh==NULL) ? 1 : VAR_SHARDS)) {
+		if (interp!=NULL) {
+			sprintf(buf,"%llu",(unsigned long long)*positionPtr);
+			Tcl_AppendResult(interp,"invalid scan position \"",buf,"\"",NULL);
+		}
+		return TCL_ERROR;
+	}
+	shard=(int)(*positionPtr>>32);
+	slot=(int)(*positionPtr&0xffffffffU);
+	if (count<1) count=1;
+	if (varMatchInit(interp,statePtr,&m,pattern,type_name)!=TCL_OK)
+		return TCL_ERROR;
+	p.proc=proc;
+	p.clientData=clientData;
+	m.proc=varMatchScan;
+	m.clientData=(ClientData)&p;
+	if (sh==NULL) {
+		varScanSlots(statePtr,&slot,count,&m);
+		*positionPtr=(slot<0) ? 0 : VAR_SCAN_POSITION(0,slot);
+		return TCL_OK;
+	}
+	SHARD_LOCK(sh,shard);
+	varScanSlots(sh->shards[shard],&slot,count,&m);
+	SHARD_UNLOCK(sh,shard);
+	if (slot>=0) *positionPtr=VAR_SCAN_POSITION(shard,slot);
+	else if (shard+1<VAR_SHARDS) *positionPtr=VAR_SCAN_POSITION(shard+1,0);
+	else *positionPtr=0;
+	return TCL_OK;
+}
+
+void varCursorOpen(StateManager_t statePtr, VarCursor *cursorPtr)
+{
+	Tcl_Preserve((ClientData)statePtr);
+	cursorPtr->state=statePtr;
+	cursorPtr->position=0;
+	cursorPtr->done=0;
+}
+
+/* collects the elements of a cursor's batch */
+static void varCursorCollect(ClientData element, const char *name,
+		ClientData clientData)
+{
+	VarCollect *c=(VarCollect*)clientData;
+	(void)name;
+	c->elements[c->len++]=element;
+}
+
+int varCursorNext(VarCursor *cursorPtr, int count, ClientData *elements)
+{
+	VarCollect c;
+	c.elements=elements;
+	c.len=0;
+	c.max=count;
+	/* a step may come back empty handed, the whole scan can't */
+	while (c.len<count && !cursorPtr->done) {
+		varScan(NULL,cursorPtr->state,&cursorPtr->position,count-c.len,
+				NULL,NULL,varCursorCollect,(ClientData)&c);
+		if (cursorPtr->position==0) cursorPtr->done=1;
+	}
+	return c.len;
+}
+
+void varCursorClose(VarCursor *cursorPtr)
+{
+	if (cursorPtr->state==NULL) return;
+	Tcl_Release((ClientData)cursorPtr->state);
+	cursorPtr->state=NULL;
+}
+
+/* Generated names are "<prefix><uid>" with a monotonically increasing
+ * uid, so a generated name is never handed out twice and only names
+ * registered explicitly by the user can collide with one. That makes
+ * allocation a single probe in all but pathological cases, no matter
+ * how many variables have come and gone. */
+static unsigned long varNextUid(StateManager_t statePtr)
+{
+	unsigned long uid;
+	if (statePtr->shared==NULL) return statePtr->uid++;
+	Tcl_MutexLock(&statePtr->shared->uid_lock);
+	uid=statePtr->shared->uid++;
+	Tcl_MutexUnlock(&statePtr->shared->uid_lock);
+	return uid;
+}
+
 int varUniqName(Tcl_Interp *interp, StateManager_t statePtr, char *name)
 {
-	char tmp[1024]="";
 	if (statePtr==NULL) return TCL_ERROR;
 	while (1) {
-		snprintf(tmp,sizeof(tmp),statePtr->prefix,statePtr->uid);
-		if (!varExists0(statePtr,tmp)) {
-			strcpy(name,tmp);
+		sprintf(name,"%s%04lu",statePtr->prefix,varNextUid(statePtr));
+		if (!varExists0(statePtr,name)) return TCL_OK;
+	};
+	return TCL_ERROR;
+}
+
+int varUniqNameObj(Tcl_Interp *interp, StateManager_t statePtr,
+		Tcl_Obj **namePtr)
+{
+	char tmp[TCL_INTEGER_SPACE+1];
+	Tcl_Obj *nameObj=NULL;
+	(void)interp;
+	if (statePtr==NULL) return TCL_ERROR;
+	nameObj=Tcl_NewStringObj(statePtr->prefix,-1);
+	while (1) {
+		sprintf(tmp,"%04lu",varNextUid(statePtr));
+		Tcl_AppendToObj(nameObj,tmp,-1);
+		if (!varExists0(statePtr,Tcl_GetString(nameObj))) {
+			*namePtr=nameObj;
 			return TCL_OK;
 		}
-		/* otherwise, increment the uid and try again */
-		statePtr->uid++;
+		Tcl_SetObjLength(nameObj,strlen(statePtr->prefix));
 	};
 	return TCL_ERROR;
 }
@@ -189,19 +890,31 @@ int varSearch(Tcl_Interp *interp, StateManager_t statePtr,
 		ClientData clientData,
 		ClientData *result)
 {
-	Tcl_HashEntry *entryPtr;
-	Tcl_HashSearch search;
+	struct VarShared *sh=statePtr->shared;
+	int i;
 	ClientData val=NULL;
 
-	/* Walk the hash table and perform the test */
-	entryPtr=Tcl_FirstHashEntry(&statePtr->hash,&search);
-	while (entryPtr!=NULL) {
-		val=Tcl_GetHashValue(entryPtr);
+	/* the search function runs with each shard locked in turn */
+	if (sh!=NULL) {
+		for (i=0;i<VAR_SHARDS;i++) {
+			SHARD_LOCK(sh,i);
+			varSearch(interp,sh->shards[i],searchFunc,clientData,&val);
+			SHARD_UNLOCK(sh,i);
+			if (val!=NULL) {
+				*result=val;
+				return TCL_OK;
+			}
+		}
+		return TCL_OK;
+	}
+
+	/* Walk the entries and perform the test */
+	for (i=0;i<statePtr->num_entries;i++) {
+		val=statePtr->entries[i].data;
 		if (searchFunc(val,clientData)==1) {
 			*result=val;
 			return TCL_OK;
 		}
-		entryPtr=Tcl_NextHashEntry(&search);
 	}
 	return TCL_OK;
 }
@@ -211,19 +924,44 @@ int registerVar(Tcl_Interp *interp, StateManager_t statePtr,
 		ClientData data, char *name,
 		REG_VAR_MODE mode)
 {
+	struct VarShared *sh=statePtr->shared;
+	StateManager_t shard=NULL;
+	ClientData old=NULL;
 	int new;
+	int slot;
 	Tcl_HashEntry *entryPtr;
+	if (sh!=NULL) {
+		/* the old data is freed outside of the lock */
+		slot=varNameShard(name);
+		shard=sh->shards[slot];
+		SHARD_LOCK(sh,slot);
+		entryPtr=Tcl_FindHashEntry(&shard->hash,name);
+		if (entryPtr!=NULL) old=ENTRY_OF(shard,entryPtr)->data;
+		registerVar(interp,shard,data,name,REG_VAR_IGNORE_OLD);
+		SHARD_UNLOCK(sh,slot);
+		if (old!=NULL && old!=data && mode==REG_VAR_DELETE_OLD)
+			statePtr->deleteProc(old);
+		return TCL_OK;
+	}
 	entryPtr=Tcl_CreateHashEntry(&statePtr->hash,name,&new);
 	if (new!=1) {
-		ClientData old=Tcl_GetHashValue(entryPtr);
+		VarEntry *e=ENTRY_OF(statePtr,entryPtr);
+		ClientData old=e->data;
 		if (old==data) {
 			/* nothing to do! This data is already registered with that name. */
 			return TCL_OK;
-		} else if (mode==REG_VAR_DELETE_OLD) {
+		}
+		/* retire the old slot, so handles to the old data go stale */
+		varSlotFree(statePtr,SLOT_OF(entryPtr));
+		slot=varSlotAlloc(statePtr,data,entryPtr);
+		Tcl_SetHashValue(entryPtr,(ClientData)(intptr_t)slot);
+		if (mode==REG_VAR_DELETE_OLD) {
 			statePtr->deleteProc(old);
 		}
+		return TCL_OK;
 	}
-	Tcl_SetHashValue(entryPtr,(ClientData)data);
+	slot=varSlotAlloc(statePtr,data,entryPtr);
+	Tcl_SetHashValue(entryPtr,(ClientData)(intptr_t)slot);
 	return TCL_OK;
 }
 
@@ -232,6 +970,7 @@ int getVarFromObj(ClientData clientData, Tcl_Interp *interp, Tcl_Obj *CONST name
 {
 	Tcl_HashEntry *entryPtr=NULL;
 	StateManager_t statePtr=(StateManager_t)clientData;
+	VarHandle handle;
 	void *iPtr=NULL;
 	if (clientData==NULL) {
 		Tcl_AppendResult(interp,"clientData was NULL",NULL);
@@ -246,12 +985,21 @@ int getVarFromObj(ClientData clientData, Tcl_Interp *interp, Tcl_Obj *CONST name
 		return TCL_ERROR;
 	}
 
+	if (statePtr->shared!=NULL) {
+		if (!varHandleFromName(statePtr,Tcl_GetString(name),&handle)
+				|| (iPtr=varGetFromHandle(statePtr,handle))==NULL) {
+			Tcl_AppendResult(interp,"Unknown var: ", Tcl_GetString(name),NULL);
+			return TCL_ERROR;
+		}
+		*iPtrPtr=iPtr;
+		return TCL_OK;
+	}
 	entryPtr=Tcl_FindHashEntry(&statePtr->hash,Tcl_GetString(name));
 	if (entryPtr==NULL) {
 		Tcl_AppendResult(interp,"Unknown var: ", Tcl_GetString(name),NULL);
 		return TCL_ERROR;
 	}
-	iPtr=(void*)Tcl_GetHashValue(entryPtr);
+	iPtr=(void*)ENTRY_OF(statePtr,entryPtr)->data;
 	*iPtrPtr=iPtr;
 	return TCL_OK;
 }
@@ -267,11 +1015,26 @@ int getVarFromObjKey(const char *state_key, Tcl_Interp *interp, Tcl_Obj *CONST n
 	return getVarFromObj(statePtr,interp,name,iPtrPtr);
 }
 
+/* collects the names found by "scan" */
+static void varScanName(ClientData element, const char *name, ClientData clientData)
+{
+	(void)element;
+	Tcl_ListObjAppendElement(NULL,(Tcl_Obj*)clientData,Tcl_NewStringObj(name,-1));
+}
+
 /* StateManagerCmd --
  * This implements the StateManager command, which has these subcommands:
  * 	names ?pattern?
+ * 	names ?-glob pattern? ?-type typename?
  * 	exists ?name?
- * 	delete name
+ * 	delete name ?name ...?
+ * 	delete -glob pattern
+ * 	delete -type typename
+ * 	scan cursor ?-count n? ?-glob pattern? ?-type typename?
+ * The delete -glob and -type forms return the number of variables deleted.
+ * scan returns the next cursor and a list of at most n names (10 by
+ * default), as Redis SCAN does: start with cursor 0 and repeat with the
+ * cursor returned until it is 0 again, see varScan().
  *
  * Results:
  *  A standard Tcl command result.
@@ -283,22 +1046,34 @@ int StateManagerCmd(ClientData clientData, Tcl_Interp *interp,
 	void *iPtr=NULL;
 	Tcl_HashEntry *entryPtr=NULL;
 	Tcl_Obj *valueObjPtr=NULL;
+	int count=0;
 
 	/* the subCmd array defines the allowed values for
 	 * the subcommand.
 	 */
 	int index=-1;
 	CONST char *subCmds[] = {
-		"delete","exists","names",NULL};
+		"delete","exists","names","scan",NULL};
 	enum StateCmdIx {
-		DeleteIx, ExistsIx, NamesIx};
+		DeleteIx, ExistsIx, NamesIx, ScanIx};
+	CONST char *namesOpts[] = {"-glob","-type",NULL};
+	enum NamesOptIx {NamesGlobIx, NamesTypeIx};
+	CONST char *scanOpts[] = {"-count","-glob","-type",NULL};
+	enum ScanOptIx {ScanCountIx, ScanGlobIx, ScanTypeIx};
+	const char *pattern=NULL, *type_name=NULL;
+	Tcl_WideInt position;
+	Tcl_Obj *pair[2];
+	uint64_t next;
+	int i;
 
 	if (objc<=1) {
 		Tcl_WrongNumArgs(interp,1,objv,"option ?arg ...?");
 		return TCL_ERROR;
 	}
 
-	if (Tcl_GetIndexFromObj(interp,objv[1],subCmds,"option",TCL_EXACT,&index)!=TCL_OK)
+	/* no interp: the error message would only be thrown away when
+	 * unknownCmd handles the subcommand, which is the common case */
+	if (Tcl_GetIndexFromObj(NULL,objv[1],subCmds,"option",TCL_EXACT,&index)!=TCL_OK)
 	{
 		return statePtr->unknownCmd(clientData,interp,objc,objv);
 	}
@@ -309,12 +1084,87 @@ int StateManagerCmd(ClientData clientData, Tcl_Interp *interp,
 			return varExistsTcl(interp,statePtr,objv[2]);
 			break;
 		case NamesIx:
-			if (objc>2) goto err;
-			return varNames(interp,statePtr);
+			if (objc==2) return varNames(interp,statePtr);
+			if (objc==3) {
+				pattern=Tcl_GetString(objv[2]);
+			} else {
+				if (objc%2!=0) goto err;
+				for (i=2;i<objc;i+=2) {
+					if (Tcl_GetIndexFromObj(interp,objv[i],namesOpts,"option",0,
+								&index)!=TCL_OK) return TCL_ERROR;
+					if (index==NamesGlobIx) pattern=Tcl_GetString(objv[i+1]);
+					else type_name=Tcl_GetString(objv[i+1]);
+				}
+			}
+			if (varNamesMatching(interp,statePtr,pattern,type_name,&valueObjPtr)!=TCL_OK)
+				return TCL_ERROR;
+			Tcl_SetObjResult(interp,valueObjPtr);
+			return TCL_OK;
+			break;
+		case ScanIx:
+			if (objc<3 || objc%2!=1) {
+				Tcl_WrongNumArgs(interp,2,objv,
+						"cursor ?-count n? ?-glob pattern? ?-type typename?");
+				return TCL_ERROR;
+			}
+			if (Tcl_GetWideIntFromObj(interp,objv[2],&position)!=TCL_OK)
+				return TCL_ERROR;
+			if (position<0) {
+				Tcl_AppendResult(interp,"invalid scan position \"",
+						Tcl_GetString(objv[2]),"\"",NULL);
+				return TCL_ERROR;
+			}
+			count=10;
+			for (i=3;i<objc;i+=2) {
+				if (Tcl_GetIndexFromObj(interp,objv[i],scanOpts,"option",0,
+							&index)!=TCL_OK) return TCL_ERROR;
+				switch (index) {
+					case ScanCountIx:
+						if (Tcl_GetIntFromObj(interp,objv[i+1],&count)!=TCL_OK)
+							return TCL_ERROR;
+						if (count<1) {
+							Tcl_AppendResult(interp,"count must be positive",NULL);
+							return TCL_ERROR;
+						}
+						break;
+					case ScanGlobIx:
+						pattern=Tcl_GetString(objv[i+1]);
+						break;
+					case ScanTypeIx:
+						type_name=Tcl_GetString(objv[i+1]);
+						break;
+				}
+			}
+			next=(uint64_t)position;
+			valueObjPtr=Tcl_NewListObj(0,NULL);
+			Tcl_IncrRefCount(valueObjPtr);
+			if (varScan(interp,statePtr,&next,count,pattern,type_name,
+						varScanName,(ClientData)valueObjPtr)!=TCL_OK) {
+				Tcl_DecrRefCount(valueObjPtr);
+				return TCL_ERROR;
+			}
+			pair[0]=Tcl_NewWideIntObj((Tcl_WideInt)next);
+			pair[1]=valueObjPtr;
+			Tcl_SetObjResult(interp,Tcl_NewListObj(2,pair));
+			Tcl_DecrRefCount(valueObjPtr);
+			return TCL_OK;
 			break;
 		case DeleteIx:
-			if (objc!=3) goto err;
-			return varDelete0(interp,statePtr, objv[2]);
+			if (objc<3) goto err;
+			if (objc==4 && strcmp(Tcl_GetString(objv[2]),"-glob")==0) {
+				if (varDeleteMatching(interp,statePtr,Tcl_GetString(objv[3]),NULL,
+							&count)!=TCL_OK) return TCL_ERROR;
+				Tcl_SetObjResult(interp,Tcl_NewIntObj(count));
+				return TCL_OK;
+			}
+			if (objc==4 && strcmp(Tcl_GetString(objv[2]),"-type")==0) {
+				if (varDeleteMatching(interp,statePtr,NULL,Tcl_GetString(objv[3]),
+							&count)!=TCL_OK) return TCL_ERROR;
+				Tcl_SetObjResult(interp,Tcl_NewIntObj(count));
+				return TCL_OK;
+			}
+			if (objc==3) return varDelete0(interp,statePtr, objv[2]);
+			return varDeleteMany(interp,statePtr,objc-2,objv+2);
 			break;
 		default:
 			return statePtr->unknownCmd(statePtr,interp,objc,objv);
@@ -326,6 +1176,62 @@ err:
 	return TCL_ERROR;
 }
 
+/* the error of a variable deleteCheckProc refuses to let go */
+static int varInUse(Tcl_Interp *interp, const char *name)
+{
+	Tcl_AppendResult(interp,"Var in use: ",name,NULL);
+	return TCL_ERROR;
+}
+
+/* unregister a variable of a shared registry by name, returning its data
+ * or NULL if there is no such variable, or deleteCheckProc refuses (then
+ * *heldPtr is set) */
+static ClientData varSharedTake(StateManager_t statePtr, const char *name,
+		int *heldPtr)
+{
+	struct VarShared *sh=statePtr->shared;
+	StateManager_t shard=NULL;
+	Tcl_HashEntry *entryPtr=NULL;
+	ClientData data=NULL;
+	int i=varNameShard(name);
+	shard=sh->shards[i];
+	*heldPtr=0;
+	SHARD_LOCK(sh,i);
+	entryPtr=Tcl_FindHashEntry(&shard->hash,name);
+	if (entryPtr!=NULL) {
+		data=ENTRY_OF(shard,entryPtr)->data;
+		if (statePtr->deleteCheckProc!=NULL && !statePtr->deleteCheckProc(data)) {
+			*heldPtr=1;
+			data=NULL;
+		} else {
+			varSlotFree(shard,SLOT_OF(entryPtr));
+			Tcl_DeleteHashEntry(entryPtr);
+		}
+	}
+	SHARD_UNLOCK(sh,i);
+	return data;
+}
+
+/* nonzero if deleteCheckProc lets the variable of that name go */
+static int varMayDelete(StateManager_t statePtr, const char *name)
+{
+	struct VarShared *sh=statePtr->shared;
+	StateManager_t shard=statePtr;
+	Tcl_HashEntry *entryPtr=NULL;
+	int i=0, result=1;
+	if (statePtr->deleteCheckProc==NULL) return 1;
+	if (sh!=NULL) {
+		i=varNameShard(name);
+		shard=sh->shards[i];
+		SHARD_LOCK(sh,i);
+	}
+	entryPtr=Tcl_FindHashEntry(&shard->hash,name);
+	if (entryPtr!=NULL)
+		result=statePtr->deleteCheckProc(ENTRY_OF(shard,entryPtr)->data);
+	if (sh!=NULL) SHARD_UNLOCK(sh,i);
+	return result;
+}
+
 /* varDelete0 --
  * Remove a variable from the state manager and free its resources.
  * Results:
@@ -336,15 +1242,534 @@ int varDelete0(Tcl_Interp *interp, StateManager_t statePtr,
 {
 	void *iPtr=NULL;
 	Tcl_HashEntry *entryPtr=NULL;
+	int held;
+	if (statePtr->shared!=NULL) {
+		iPtr=varSharedTake(statePtr,Tcl_GetString(objName),&held);
+		if (held) return varInUse(interp,Tcl_GetString(objName));
+		if (iPtr==NULL) {
+			Tcl_AppendResult(interp,"Unknown var: ",
+					Tcl_GetString(objName),NULL);
+			return TCL_ERROR;
+		}
+		statePtr->deleteProc(iPtr);
+		return TCL_OK;
+	}
 	entryPtr=Tcl_FindHashEntry(&statePtr->hash,Tcl_GetString(objName));
 	if (entryPtr==NULL) {
 		Tcl_AppendResult(interp,"Unknown var: ",
 				Tcl_GetString(objName),NULL);
 		return TCL_ERROR;
 	}
-	iPtr=Tcl_GetHashValue(entryPtr);
-	statePtr->deleteProc(iPtr);
+	iPtr=ENTRY_OF(statePtr,entryPtr)->data;
+	if (statePtr->deleteCheckProc!=NULL && !statePtr->deleteCheckProc(iPtr))
+		return varInUse(interp,Tcl_GetString(objName));
+	/* unregister first, so deleteProc sees a consistent registry */
+	varSlotFree(statePtr,SLOT_OF(entryPtr));
 	Tcl_DeleteHashEntry(entryPtr);
+	statePtr->deleteProc(iPtr);
+	return TCL_OK;
+}
+
+TCL_DECLARE_MUTEX(stateSerialMutex)
+static unsigned long stateSerial=0;
+
+/* Unregister the variables in the given slots, then run deleteProc on
+ * all of them, so that the registry is consistent (and no longer mentions
+ * any of them) while the resources are being freed. */
+static void varDeleteSlots(StateManager_t statePtr, int *slots, int n)
+{
+	ClientData *data=NULL;
+	VarEntry *e;
+	int i;
+	if (n==0) return;
+	data=(ClientData*)ckalloc(n*sizeof(ClientData));
+	for (i=0;i<n;i++) {
+		e=&statePtr->entries[statePtr->slots[slots[i]].index];
+		data[i]=e->data;
+		Tcl_DeleteHashEntry(e->hPtr);
+		varSlotFree(statePtr,slots[i]);
+	}
+	for (i=0;i<n;i++) statePtr->deleteProc(data[i]);
+	ckfree((char*)data);
+}
+
+static int varCompareInt(const void *a, const void *b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+int varDeleteMany(Tcl_Interp *interp, StateManager_t statePtr,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	Tcl_HashEntry *entryPtr=NULL;
+	ClientData *data=NULL;
+	int *slots=NULL;
+	int i, n=0, held;
+	if (objc<=0) return TCL_OK;
+	/* check them all first, so that an unknown name deletes nothing */
+	for (i=0;i<objc;i++) {
+		if (!varExists0(statePtr,Tcl_GetString(objv[i]))) {
+			Tcl_AppendResult(interp,"Unknown var: ",
+					Tcl_GetString(objv[i]),NULL);
+			return TCL_ERROR;
+		}
+		if (!varMayDelete(statePtr,Tcl_GetString(objv[i])))
+			return varInUse(interp,Tcl_GetString(objv[i]));
+	}
+	if (statePtr->shared!=NULL) {
+		/* a name given twice (or deleted meanwhile) is only taken once */
+		data=(ClientData*)ckalloc(objc*sizeof(ClientData));
+		for (i=0;i<objc;i++) {
+			data[n]=varSharedTake(statePtr,Tcl_GetString(objv[i]),&held);
+			if (data[n]!=NULL) n++;
+		}
+		for (i=0;i<n;i++) statePtr->deleteProc(data[i]);
+		ckfree((char*)data);
+		return TCL_OK;
+	}
+	slots=(int*)ckalloc(objc*sizeof(int));
+	for (i=0;i<objc;i++) {
+		entryPtr=Tcl_FindHashEntry(&statePtr->hash,Tcl_GetString(objv[i]));
+		slots[i]=SLOT_OF(entryPtr);
+	}
+	/* drop names given more than once */
+	qsort(slots,objc,sizeof(int),varCompareInt);
+	for (i=0;i<objc;i++) {
+		if (n==0 || slots[n-1]!=slots[i]) slots[n++]=slots[i];
+	}
+	varDeleteSlots(statePtr,slots,n);
+	ckfree((char*)slots);
+	return TCL_OK;
+}
+
+/* Unregister the variables of a private state (or shard) that match the
+ * pattern and type key and that checkProc (if not NULL) lets go,
+ * appending their data to *dataPtr, which has room for *maxPtr elements
+ * and holds *nPtr. */
+static void varTakeMatching(StateManager_t statePtr, const char *pattern,
+		varTypeKeyFunction typeKeyProc, uint64_t key,
+		varDeleteCheckFunction checkProc,
+		ClientData **dataPtr, int *nPtr, int *maxPtr)
+{
+	VarTypeIndex *ti=NULL;
+	VarEntry *e;
+	int i;
+	if (*nPtr+statePtr->num_entries>*maxPtr) {
+		*maxPtr=*nPtr+statePtr->num_entries;
+		*dataPtr=(ClientData*)ckrealloc((char*)*dataPtr,*maxPtr*sizeof(ClientData));
+	}
+	/* one pass over the dense entries (or those of the type), backwards
+	 * since each match is replaced by the last entry */
+	if (typeKeyProc!=NULL && statePtr->typeKeyProc!=NULL) {
+		ti=varTypeIndex(statePtr,key,0);
+		for (i=(ti==NULL) ? -1 : ti->num_slots-1;i>=0;i--) {
+			e=&statePtr->entries[statePtr->slots[ti->slots[i]].index];
+			if (pattern!=NULL
+					&& !Tcl_StringMatch(Tcl_GetHashKey(&statePtr->hash,e->hPtr),pattern))
+				continue;
+			if (checkProc!=NULL && !checkProc(e->data)) continue;
+			(*dataPtr)[(*nPtr)++]=e->data;
+			Tcl_DeleteHashEntry(e->hPtr);
+			varSlotFree(statePtr,e->slot);
+		}
+		return;
+	}
+	for (i=statePtr->num_entries-1;i>=0;i--) {
+		e=&statePtr->entries[i];
+		if (typeKeyProc!=NULL && typeKeyProc(e->data)!=key) continue;
+		if (pattern!=NULL
+				&& !Tcl_StringMatch(Tcl_GetHashKey(&statePtr->hash,e->hPtr),pattern))
+			continue;
+		if (checkProc!=NULL && !checkProc(e->data)) continue;
+		(*dataPtr)[(*nPtr)++]=e->data;
+		Tcl_DeleteHashEntry(e->hPtr);
+		varSlotFree(statePtr,e->slot);
+	}
+}
+
+/* unregister the matching variables of all shards of a shared registry
+ * (or the state itself), then delete them */
+static int varDeleteTaken(StateManager_t statePtr, const char *pattern,
+		varTypeKeyFunction typeKeyProc, uint64_t key,
+		varDeleteCheckFunction checkProc)
+{
+	struct VarShared *sh=statePtr->shared;
+	ClientData *data=NULL;
+	int i, n=0, max=0;
+	if (sh==NULL) {
+		varTakeMatching(statePtr,pattern,typeKeyProc,key,checkProc,&data,&n,&max);
+	} else {
+		for (i=0;i<VAR_SHARDS;i++) {
+			SHARD_LOCK(sh,i);
+			varTakeMatching(sh->shards[i],pattern,typeKeyProc,key,checkProc,
+					&data,&n,&max);
+			SHARD_UNLOCK(sh,i);
+		}
+	}
+	/* all of them are unregistered before the first is freed */
+	for (i=0;i<n;i++) statePtr->deleteProc(data[i]);
+	if (data!=NULL) ckfree((char*)data);
+	return n;
+}
+
+int varDeleteMatching(Tcl_Interp *interp, StateManager_t statePtr,
+		const char *pattern, const char *type_name, int *countPtr)
+{
+	varTypeKeyFunction typeKeyProc=NULL;
+	uint64_t key=0;
+	int n;
+	if (type_name!=NULL) {
+		if (statePtr->typeKeyProc==NULL || statePtr->typeNameKeyProc==NULL) {
+			Tcl_AppendResult(interp,"variables of this state have no types",NULL);
+			return TCL_ERROR;
+		}
+		typeKeyProc=statePtr->typeKeyProc;
+		key=statePtr->typeNameKeyProc(type_name);
+	}
+	n=varDeleteTaken(statePtr,pattern,typeKeyProc,key,statePtr->deleteCheckProc);
+	if (countPtr!=NULL) *countPtr=n;
+	return TCL_OK;
+}
+
+/* allocate and initialize a state; it is not associated with any
+ * interpreter (nor has a command) yet */
+static StateManager_t varNewState(const char *key, const char *prefix,
+		int (*unknownCmd)(ClientData,Tcl_Interp*,int,Tcl_Obj *CONST objv[]),
+		void (*deleteProc)(void *ptr))
+{
+	StateManager_t state=NULL;
+	state=(StateManager_t)ckalloc(sizeof(struct StateManager_s));
+	Tcl_InitHashTable(&state->hash,TCL_STRING_KEYS);
+	state->interp=NULL;
+	state->key=(char*)ckalloc(strlen(key)+1);
+	strcpy(state->key,key);
+	state->slots=NULL;
+	state->num_slots=state->max_slots=0;
+	state->free_slot=-1;
+	state->entries=NULL;
+	state->num_entries=state->max_entries=0;
+	state->uid=0;
+	state->deleteProc=deleteProc;
+	state->teardown_threads=1;
+	state->teardownProc=NULL;
+	state->deleteCheckProc=NULL;
+	state->unknownCmd=unknownCmd;
+	state->typeKeyProc=NULL;
+	state->typeNameKeyProc=NULL;
+	Tcl_InitHashTable(&state->type_index,TCL_ONE_WORD_KEYS);
+	state->last_type=NULL;
+	Tcl_MutexLock(&stateSerialMutex);
+	state->serial=++stateSerial;
+	Tcl_MutexUnlock(&stateSerialMutex);
+	Tcl_InitHashTable(&state->type_table,TCL_ONE_WORD_KEYS);
+	state->max_num_reg_types=0;
+	state->num_reg_types=0;
+	state->reg_types=NULL;
+	state->ext=NULL;
+	state->extFreeProc=NULL;
+	state->shared=NULL;
+	state->root=state;
+	state->prefix=(char*)ckalloc(strlen(prefix)+1);
+	strcpy(state->prefix,prefix);
+	return state;
+}
+
+/* varAttachShared --
+ * Turn the state into a view of the shared registry under its key.
+ * Results:
+ *  A standard Tcl command result.
+ */
+int varAttachShared(Tcl_Interp *interp, StateManager_t statePtr)
+{
+	struct VarShared *sh=NULL;
+	StateManager_t root=NULL;
+	int i;
+	if (statePtr->shared!=NULL) return TCL_OK;
+	if (statePtr->num_entries>0) {
+		Tcl_AppendResult(interp,"cannot share a registry that holds variables",NULL);
+		return TCL_ERROR;
+	}
+	Tcl_MutexLock(&sharedListMutex);
+	for (sh=sharedList;sh!=NULL;sh=sh->next) {
+		if (strcmp(sh->key,statePtr->key)==0) break;
+	}
+	if (sh==NULL) {
+		sh=(struct VarShared*)ckalloc(sizeof(struct VarShared));
+		memset(sh,0,sizeof(struct VarShared));
+		sh->key=(char*)ckalloc(strlen(statePtr->key)+1);
+		strcpy(sh->key,statePtr->key);
+		for (i=0;i<VAR_SHARDS;i++) {
+			sh->shards[i]=varNewState(statePtr->key,statePtr->prefix,NULL,NULL);
+			sh->shards[i]->typeKeyProc=statePtr->typeKeyProc;
+		}
+		root=varNewState(statePtr->key,statePtr->prefix,
+				statePtr->unknownCmd,statePtr->deleteProc);
+		root->typeKeyProc=statePtr->typeKeyProc;
+		root->typeNameKeyProc=statePtr->typeNameKeyProc;
+		root->shared=sh;
+		sh->root=root;
+		sh->next=sharedList;
+		sharedList=sh;
+	}
+	while (sh->draining && sh->drainer!=Tcl_GetCurrentThread())
+		Tcl_ConditionWait(&sharedDrained,&sharedListMutex,NULL);
+	sh->users++;
+	Tcl_MutexUnlock(&sharedListMutex);
+	statePtr->shared=sh;
+	statePtr->root=sh->root;
+	/* handles cached against the private registry are no longer valid */
+	Tcl_MutexLock(&stateSerialMutex);
+	statePtr->serial=++stateSerial;
+	Tcl_MutexUnlock(&stateSerialMutex);
+	return TCL_OK;
+}
+
+void varLock(StateManager_t statePtr)
+{
+	if (statePtr->shared!=NULL) Tcl_MutexLock(&statePtr->shared->lock);
+}
+
+void varUnlock(StateManager_t statePtr)
+{
+	if (statePtr->shared!=NULL) Tcl_MutexUnlock(&statePtr->shared->lock);
+}
+
+/* varParallelApply() runs on a pool of threads shared by the process,
+ * created as needed and joined at exit. The caller takes part as worker
+ * 0. Each worker starts out with an equal range of the elements and takes
+ * chunks off its front; once its range is empty it steals the upper half
+ * of the largest range left, so that uneven costs even out. One job runs
+ * at a time; a call made while the pool is busy (including from within
+ * a job) just runs on the calling thread. */
+#define VAR_POOL_MAX 64
+
+typedef struct VarRange {
+	Tcl_Mutex lock;
+	int lo, hi; /* elements not taken yet */
+} VarRange;
+
+typedef struct VarJob {
+	ClientData *elements;
+	varForEachFunction fn;
+	ClientData clientData;
+	int nworkers;
+	int next_worker; /* index handed to the next pool thread to join */
+	int pending; /* pool threads still working on it */
+	int chunk;
+	VarRange *ranges;
+	int failures;
+} VarJob;
+
+TCL_DECLARE_MUTEX(poolMutex)
+static Tcl_Condition poolWorkCond; /* a new job, or time to stop */
+static Tcl_Condition poolDoneCond; /* the pool threads finished a job */
+static Tcl_ThreadId poolThreads[VAR_POOL_MAX];
+static int poolNumThreads=0;
+static int poolBusy=0, poolStop=0;
+static VarJob *poolJob=NULL;
+static unsigned long poolSerial=0; /* bumped for each job */
+
+/* take the next chunk of worker w, stealing if its range is empty.
+ * Returns 0 when nothing is left anywhere. */
+static int varJobTake(VarJob *job, int w, int *loPtr, int *hiPtr)
+{
+	VarRange *own=&job->ranges[w], *victim=NULL;
+	int i, best, left, mid, hi;
+	while (1) {
+		Tcl_MutexLock(&own->lock);
+		if (own->lo<own->hi) {
+			*loPtr=own->lo;
+			own->lo=(own->hi-own->lo>job->chunk) ? own->lo+job->chunk : own->hi;
+			*hiPtr=own->lo;
+			Tcl_MutexUnlock(&own->lock);
+			return 1;
+		}
+		Tcl_MutexUnlock(&own->lock);
+		/* the largest range left; sizes may change until it is locked */
+		victim=NULL;
+		best=0;
+		for (i=0;i<job->nworkers;i++) {
+			if (i==w) continue;
+			Tcl_MutexLock(&job->ranges[i].lock);
+			left=job->ranges[i].hi-job->ranges[i].lo;
+			Tcl_MutexUnlock(&job->ranges[i].lock);
+			if (left>best) {
+				best=left;
+				victim=&job->ranges[i];
+			}
+		}
+		if (victim==NULL) return 0;
+		Tcl_MutexLock(&victim->lock);
+		left=victim->hi-victim->lo;
+		if (left<=0) {
+			Tcl_MutexUnlock(&victim->lock);
+			continue;
+		}
+		mid=victim->lo+left/2;
+		hi=victim->hi;
+		victim->hi=mid;
+		Tcl_MutexUnlock(&victim->lock);
+		/* nobody steals from an empty range, so the two locks need not
+		 * be held at once */
+		Tcl_MutexLock(&own->lock);
+		own->lo=mid;
+		own->hi=hi;
+		Tcl_MutexUnlock(&own->lock);
+	}
+}
+
+static void varJobRun(VarJob *job, int w)
+{
+	int lo, hi, i, failures=0;
+	while (varJobTake(job,w,&lo,&hi)) {
+		for (i=lo;i<hi;i++) {
+			if (job->fn(job->elements[i],job->clientData)!=TCL_OK) failures++;
+		}
+	}
+	if (failures>0) {
+		Tcl_MutexLock(&poolMutex);
+		job->failures+=failures;
+		Tcl_MutexUnlock(&poolMutex);
+	}
+}
+
+static Tcl_ThreadCreateType varPoolThreadProc(ClientData data)
+{
+	unsigned long seen=0;
+	VarJob *job=NULL;
+	int w;
+	(void)data;
+	Tcl_MutexLock(&poolMutex);
+	while (1) {
+		while (!poolStop && (poolJob==NULL || poolSerial==seen))
+			Tcl_ConditionWait(&poolWorkCond,&poolMutex,NULL);
+		if (poolStop) break;
+		seen=poolSerial;
+		job=poolJob;
+		if (job->next_worker>=job->nworkers) continue;
+		w=job->next_worker++;
+		Tcl_MutexUnlock(&poolMutex);
+		varJobRun(job,w);
+		Tcl_MutexLock(&poolMutex);
+		if (--job->pending==0) Tcl_ConditionNotify(&poolDoneCond);
+	}
+	Tcl_MutexUnlock(&poolMutex);
+	/* run the thread exit handlers the functions called may have set up */
+	Tcl_FinalizeThread();
+	TCL_THREAD_CREATE_RETURN;
+}
+
+static void varPoolExit(ClientData data)
+{
+	int i, result;
+	(void)data;
+	Tcl_MutexLock(&poolMutex);
+	poolStop=1;
+	Tcl_ConditionNotify(&poolWorkCond);
+	Tcl_MutexUnlock(&poolMutex);
+	for (i=0;i<poolNumThreads;i++) Tcl_JoinThread(poolThreads[i],&result);
+	poolNumThreads=0;
+}
+
+/* the number of processors, the default number of workers */
+static int varNumProcessors(void)
+{
+#if defined(_SC_NPROCESSORS_ONLN)
+	long n=sysconf(_SC_NPROCESSORS_ONLN);
+	if (n>0) return (n>VAR_POOL_MAX) ? VAR_POOL_MAX : (int)n;
+#endif
+	return 4;
+}
+
+int varParallelApply(ClientData *elements, int len, varForEachFunction fn,
+		ClientData clientData, int nthreads)
+{
+	VarJob job;
+	int i, serial=0;
+	if (len<=0) return 0;
+	if (nthreads<=0) nthreads=varNumProcessors();
+	if (nthreads>VAR_POOL_MAX+1) nthreads=VAR_POOL_MAX+1;
+	if (nthreads>len) nthreads=len;
+	memset(&job,0,sizeof(job));
+	job.elements=elements;
+	job.fn=fn;
+	job.clientData=clientData;
+
+	Tcl_MutexLock(&poolMutex);
+	if (poolBusy || poolStop || nthreads<=1) {
+		serial=1;
+	} else {
+		poolBusy=1;
+		if (poolNumThreads==0) Tcl_CreateExitHandler(varPoolExit,NULL);
+		while (poolNumThreads<nthreads-1) {
+			if (Tcl_CreateThread(&poolThreads[poolNumThreads],varPoolThreadProc,NULL,
+						TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)!=TCL_OK) break;
+			poolNumThreads++;
+		}
+		if (poolNumThreads+1<nthreads) nthreads=poolNumThreads+1;
+		if (nthreads<=1) {
+			poolBusy=0;
+			serial=1;
+		}
+	}
+	if (serial) {
+		Tcl_MutexUnlock(&poolMutex);
+		for (i=0;i<len;i++) {
+			if (fn(elements[i],clientData)!=TCL_OK) job.failures++;
+		}
+		return job.failures;
+	}
+	job.nworkers=nthreads;
+	job.chunk=len/(nthreads*16)+1;
+	job.ranges=(VarRange*)ckalloc(nthreads*sizeof(VarRange));
+	memset(job.ranges,0,nthreads*sizeof(VarRange));
+	for (i=0;i<nthreads;i++) {
+		job.ranges[i].lo=(int)((long long)len*i/nthreads);
+		job.ranges[i].hi=(int)((long long)len*(i+1)/nthreads);
+		/* Tcl creates a mutex on first use */
+		Tcl_MutexLock(&job.ranges[i].lock);
+		Tcl_MutexUnlock(&job.ranges[i].lock);
+	}
+	job.next_worker=1;
+	job.pending=nthreads-1;
+	poolJob=&job;
+	poolSerial++;
+	Tcl_ConditionNotify(&poolWorkCond);
+	Tcl_MutexUnlock(&poolMutex);
+
+	varJobRun(&job,0);
+
+	Tcl_MutexLock(&poolMutex);
+	while (job.pending>0) Tcl_ConditionWait(&poolDoneCond,&poolMutex,NULL);
+	poolJob=NULL;
+	poolBusy=0;
+	Tcl_MutexUnlock(&poolMutex);
+	for (i=0;i<nthreads;i++) Tcl_MutexFinalize(&job.ranges[i].lock);
+	ckfree((char*)job.ranges);
+	return job.failures;
+}
+
+/* varParallelForEach --
+ * Call fn on every element of type type_name (all elements if NULL).
+ * Results:
+ *  A standard Tcl command result.
+ */
+int varParallelForEach(Tcl_Interp *interp, StateManager_t statePtr,
+		const char *type_name, varForEachFunction fn, ClientData clientData,
+		int nthreads)
+{
+	ClientData *elements=NULL;
+	char buf[2*TCL_INTEGER_SPACE+32];
+	int len=0, failures;
+	if (varElementsOfType(interp,statePtr,type_name,&elements,&len)!=TCL_OK)
+		return TCL_ERROR;
+	failures=varParallelApply(elements,len,fn,clientData,nthreads);
+	free(elements);
+	if (failures>0) {
+		sprintf(buf,"%d of %d calls failed",failures,len);
+		Tcl_AppendResult(interp,buf,NULL);
+		return TCL_ERROR;
+	}
 	return TCL_OK;
 }
 
@@ -362,25 +1787,17 @@ int InitializeStateManager(Tcl_Interp *interp, const char *key,
 
 
 	StateManager_t state=NULL;
+	char *prefix=NULL;
 	if (NULL!=Tcl_GetAssocData(interp,key,NULL)) return TCL_OK;
 	/* otherwise, we need to create a new context and associate it with
 	 * the Tcl interpreter.
 	 */
-	state=(StateManager_t)ckalloc(sizeof(struct StateManager_s));
-	Tcl_InitHashTable(&state->hash,TCL_STRING_KEYS);
+	prefix=(char*)ckalloc(strlen(cmd_name)+2);
+	sprintf(prefix,"%s#",cmd_name);
+	state=varNewState(key,prefix,unknownCmd,deleteProc);
+	ckfree(prefix);
 	Tcl_SetAssocData(interp,key,NULL,(ClientData)state);
-	state->uid=0;
-	state->deleteProc=deleteProc;
-	state->unknownCmd=unknownCmd;
-	state->max_num_reg_types=100;
-	state->num_reg_types=0;
-	state->reg_type_names=(char**)ckalloc(101*sizeof(char*));
-	memset(state->reg_type_names,0,101*sizeof(char*));
-	state->reg_types_create_procs=(CreateObjFunc*)ckalloc(100*sizeof(CreateObjFunc));
-	state->reg_types_instance_commands=(InstanceCommandFunc*)ckalloc(100*sizeof(InstanceCommandFunc));
+	state->interp=interp;
 	Tcl_CreateObjCommand(interp,cmd_name, StateManagerCmd, (ClientData)state,StateManagerDeleteProc);
-	int len=strlen(cmd_name);
-	state->prefix=(char*)ckalloc(len+6);
-	sprintf(state->prefix,"%s%s",cmd_name,"#%04d");
 	return TCL_OK;
 }
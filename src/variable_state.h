@@ -36,25 +36,107 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
 #include <tcl.h>
 
 typedef int (*CreateObjFunc)
 			(ClientData, Tcl_Interp *, int, Tcl_Obj *CONST objv[], void *);
 typedef int (*InstanceCommandFunc)
 			(ClientData, Tcl_Interp *, int, Tcl_Obj *CONST objv[]);
+struct cObjType;
+
+/* Handle to a registered variable: the slot index in the low 32 bits
+ * and the slot generation in the high 32 bits. A handle goes stale as soon
+ * as its variable is deleted, even if the slot is later reused. */
+typedef uint64_t VarHandle;
+#define VAR_HANDLE(slot,gen) (((VarHandle)(gen)<<32)|(VarHandle)(uint32_t)(slot))
+#define VAR_HANDLE_SLOT(h) ((int)((h)&0xffffffffU))
+#define VAR_HANDLE_GEN(h) ((unsigned int)((h)>>32))
+
+/* a slot of the registry. Slots never move, so handles can index them. */
+typedef struct VarSlot {
+	unsigned int gen; /* bumped each time the slot is freed */
+	int index; /* position in entries[] if in use, else next free slot */
+} VarSlot;
+
+/* The variables of one type, so that operations on a type only touch
+ * its own variables. The slots are kept dense, in no particular order. */
+typedef struct VarTypeIndex {
+	uint64_t key;
+	int *slots;
+	int num_slots, max_slots;
+} VarTypeIndex;
+
+/* a registered variable. entries[] is kept dense, so walking all
+ * variables is a walk over a contiguous array. */
+typedef struct VarEntry {
+	ClientData data;
+	Tcl_HashEntry *hPtr; /* entry in the name hash (holding the slot index) */
+	int slot;
+	int type_pos; /* position in the index of its type */
+	VarTypeIndex *type_index; /* NULL if types are not known */
+} VarEntry;
+
+/* Optional type information for the variables of a state: the key of the
+ * type of an element, and the key for a type name. Set by the layer on top
+ * of the state (e.g. cobj_state.c) to enable operations by type, before
+ * any variable is registered, as the per-type indexes are kept from then
+ * on. */
+typedef uint64_t (*varTypeKeyFunction)(ClientData element);
+typedef uint64_t (*varTypeNameKeyFunction)(const char *type_name);
+/* At teardown, called on the exiting thread for each element; nonzero if
+ * deleteProc may run on the element from another thread, concurrently
+ * with the others. */
+typedef int (*varTeardownFunction)(ClientData element);
+/* Asked before an element is deleted by name, pattern or type (but not
+ * at teardown); zero keeps it registered, e.g. while a script holds it. */
+typedef int (*varDeleteCheckFunction)(ClientData element);
+
+/* a process-wide registry, see varAttachShared() */
+struct VarShared;
+
 /* generic state management structure. Maps var names to blobs.
  * Created once per interpreter */
 struct StateManager_s {
-	Tcl_HashTable hash; /* list of variables by name */
-	int uid;
-	char *prefix;
+	Tcl_HashTable hash; /* variable names, mapping to slot indices */
+	VarSlot *slots;
+	int num_slots, max_slots;
+	int free_slot; /* head of the free slot list, -1 if empty */
+	VarEntry *entries;
+	int num_entries, max_entries;
+	Tcl_Interp *interp; /* interpreter owning this state */
+	char *key; /* assoc data key the state is stored under */
+	unsigned long uid; /* next id handed out by varUniqName(), never reused */
+	char *prefix; /* cmd_name followed by '#' */
 	void (*deleteProc)(void *ptr);
+	/* threads deleting the variables when the state is torn down, as for
+	 * varParallelApply(): 1 (the default) deletes them all on the exiting
+	 * thread; otherwise those teardownProc accepts are spread over them */
+	int teardown_threads;
+	varTeardownFunction teardownProc;
+	varDeleteCheckFunction deleteCheckProc; /* NULL if all may be deleted */
 	int (*unknownCmd)(ClientData, Tcl_Interp *,int,Tcl_Obj *CONST objv[]);
-	int max_num_reg_types; /* 100 */
-	int num_reg_types; /* 0 */
-	char **reg_type_names; /* max+1 to end in NULL */
-	CreateObjFunc *reg_types_create_procs;
-	InstanceCommandFunc *reg_types_instance_commands;
+	varTypeKeyFunction typeKeyProc; /* NULL if types are not known */
+	varTypeNameKeyFunction typeNameKeyProc;
+	Tcl_HashTable type_index; /* type key to VarTypeIndex */
+	VarTypeIndex *last_type; /* the index used last, often used next */
+	unsigned long serial; /* unique within the process */
+	/* registered types (see cobj_state.h). The table is keyed by the type
+	 * hash and holds the first descriptor with that hash. */
+	Tcl_HashTable type_table;
+	int max_num_reg_types; /* grows as needed */
+	int num_reg_types;
+	struct cObjType **reg_types; /* descriptors, in registration order */
+	/* data of the layer built on top of the state (e.g. cobj_state.c),
+	 * freed by extFreeProc together with the state itself */
+	ClientData ext;
+	Tcl_FreeProc *extFreeProc;
+	/* the process-wide registry this state is a view of, or NULL if its
+	 * variables are private to the interpreter */
+	struct VarShared *shared;
+	/* the state holding the types and ext data that go with the variables:
+	 * the state itself, or the root of the shared registry */
+	struct StateManager_s *root;
 };
 
 /* generic state management structure. Maps var names to blobs.
@@ -73,14 +155,73 @@ extern int DLLEXPORT varExistsTcl(Tcl_Interp *interp,
  */
 extern int DLLEXPORT varElements(Tcl_Interp *interp, StateManager_t statePtr,
 		ClientData **elements, int *len);
+/* As varElements(), but only the elements of type type_name, found through
+ * the index of the type without looking at any other element. */
+extern int DLLEXPORT varElementsOfType(Tcl_Interp *interp, StateManager_t statePtr,
+		const char *type_name, ClientData **elements, int *len);
 typedef int (*varSearchFunction)(ClientData element, ClientData clientData);
 extern int DLLEXPORT varSearch(Tcl_Interp *interp, StateManager_t statePtr,
 		varSearchFunction search_function,
 		ClientData clientData, ClientData *result);
 extern int DLLEXPORT varNames(Tcl_Interp *interp, StateManager_t statePtr);
 extern int DLLEXPORT varNamesList(Tcl_Interp *interp, StateManager_t statePtr, Tcl_Obj **list);
-/* generate a uniqe variable name */
+/* The names matching the glob pattern whose type is type_name (either may
+ * be NULL to match everything). A pattern without glob characters is
+ * looked up directly, and a type through its index. */
+extern int DLLEXPORT varNamesMatching(Tcl_Interp *interp, StateManager_t statePtr,
+		const char *pattern, const char *type_name, Tcl_Obj **list);
+/* generate a uniqe variable name. name must have room for the prefix
+ * (the state command name plus '#') and 20 digits. */
 extern int DLLEXPORT varUniqName(Tcl_Interp *interp, StateManager_t statePtr, char *name);
+/* generate a unique variable name as a new Tcl_Obj with a zero refcount */
+extern int DLLEXPORT varUniqNameObj(Tcl_Interp *interp, StateManager_t statePtr,
+		Tcl_Obj **namePtr);
+
+/* Scan the variables in bounded steps, for enumerating a large registry
+ * without a snapshot of it. *positionPtr is 0 to start, and is set to
+ * where the next step goes on, or to 0 when the scan is complete. Each
+ * step passes at most count variables matching the glob pattern and type
+ * (either may be NULL) to proc, and may pass none. Variables that exist
+ * for the whole scan are passed exactly once, however many are created
+ * or deleted meanwhile; the state may change between steps, but not
+ * from within proc. */
+typedef void (*varScanFunction)(ClientData element, const char *name,
+		ClientData clientData);
+extern int DLLEXPORT varScan(Tcl_Interp *interp, StateManager_t statePtr,
+		uint64_t *positionPtr, int count, const char *pattern,
+		const char *type_name, varScanFunction proc, ClientData clientData);
+
+/* A cursor over all the elements of a state, built on varScan(). Open
+ * keeps the state alive until close; next fills elements with up to count
+ * elements, returning how many, and 0 only once all have been seen. */
+typedef struct VarCursor {
+	StateManager_t state;
+	uint64_t position;
+	int done;
+} VarCursor;
+extern void DLLEXPORT varCursorOpen(StateManager_t statePtr, VarCursor *cursorPtr);
+extern int DLLEXPORT varCursorNext(VarCursor *cursorPtr, int count,
+		ClientData *elements);
+extern void DLLEXPORT varCursorClose(VarCursor *cursorPtr);
+
+/* Call fn on each of len elements from nthreads threads (the number of
+ * processors if nthreads<=0), the calling thread being one of them. The
+ * threads are kept in a pool shared by the process; if it is already
+ * running a job, the calls are made on the calling thread. Returns the
+ * number of calls which did not return TCL_OK. fn may be called
+ * concurrently, in any order. */
+typedef int (*varForEachFunction)(ClientData element, ClientData clientData);
+extern int DLLEXPORT varParallelApply(ClientData *elements, int len,
+		varForEachFunction fn, ClientData clientData, int nthreads);
+/* varParallelApply() over the elements of type type_name (all if NULL).
+ * The elements must stay registered until it returns. */
+extern int DLLEXPORT varParallelForEach(Tcl_Interp *interp, StateManager_t statePtr,
+		const char *type_name, varForEachFunction fn, ClientData clientData,
+		int nthreads);
+
+/* make room for count more variables, so that registering them
+ * will not need to grow the registry */
+extern int DLLEXPORT varReserve(StateManager_t statePtr, int count);
 
 /* enumeration for registration modes */
 typedef enum {REG_VAR_DELETE_OLD,
@@ -90,15 +231,63 @@ typedef enum {REG_VAR_DELETE_OLD,
 extern int DLLEXPORT
 	registerVar(Tcl_Interp *interp, StateManager_t statePtr, ClientData data, char *name, REG_VAR_MODE mode);
 
-/* de-register a variable and free its resources */
+/* de-register a variable and free its resources, unless deleteCheckProc
+ * refuses */
 extern int DLLEXPORT varDelete0(Tcl_Interp *interp, StateManager_t statePtr,
 		Tcl_Obj *objName);
 
+/* De-register several variables in one pass and then free their
+ * resources. Either all the named variables exist (and deleteCheckProc
+ * lets them go) and are deleted, or none is. */
+extern int DLLEXPORT varDeleteMany(Tcl_Interp *interp, StateManager_t statePtr,
+		int objc, Tcl_Obj *CONST objv[]);
+/* De-register all variables whose name matches the glob pattern and whose
+ * type is type_name (either may be NULL to match everything), then free
+ * their resources. Those deleteCheckProc refuses are left registered.
+ * The number deleted is left in *countPtr if not NULL. */
+extern int DLLEXPORT varDeleteMatching(Tcl_Interp *interp, StateManager_t statePtr,
+		const char *pattern, const char *type_name, int *countPtr);
+
 extern int DLLEXPORT getVarFromObj(ClientData clientData, Tcl_Interp *interp, Tcl_Obj *CONST name,
 		void **iPtrPtr);
 extern int DLLEXPORT getVarFromObjKey(const char *state_key, Tcl_Interp *interp, Tcl_Obj *CONST name,
 		void **iPtrPtr);
 
+/* Look up the handle of a variable by name. Returns 1 if found. */
+extern int DLLEXPORT varHandleFromName(StateManager_t statePtr, const char *name,
+		VarHandle *handlePtr);
+/* Return the data registered under a handle, or NULL if the handle is stale */
+extern ClientData DLLEXPORT varGetFromHandle(StateManager_t statePtr, VarHandle handle);
+/* Return the name of the variable under a handle, or NULL if the handle is stale */
+extern DLLEXPORT const char *varNameFromHandle(StateManager_t statePtr, VarHandle handle);
+/* Remove the variable under a handle from the registry without calling
+ * deleteProc, for data whose lifetime is managed elsewhere. Returns the
+ * data, or NULL if the handle is stale. */
+extern ClientData DLLEXPORT varUnregisterHandle(StateManager_t statePtr, VarHandle handle);
+
+/* Like varGetFromHandle(), but acquireProc (if not NULL) is called on the
+ * data while the registry cannot change, e.g. to take a reference to it
+ * that a concurrent delete cannot race with. If it returns 0 the data is
+ * treated as gone and NULL is returned. */
+typedef int (*varAcquireFunction)(ClientData element);
+extern ClientData DLLEXPORT varAcquireFromHandle(StateManager_t statePtr, VarHandle handle,
+		varAcquireFunction acquireProc);
+
+/* Make the state of an interpreter a view of the process-wide registry
+ * kept under the same key, creating the registry on first use. The state
+ * must not hold any variables yet. Variables registered through any view
+ * can be looked up and deleted through all of them, from any thread; the
+ * registry is split into shards with a lock each, so that threads rarely
+ * contend. Data returned by the lookup functions is not protected against
+ * concurrent deletion, use varAcquireFromHandle() for that. Shared
+ * registries live until the process exits, but the variables left in
+ * one are deleted along with its last view. */
+extern int DLLEXPORT varAttachShared(Tcl_Interp *interp, StateManager_t statePtr);
+/* Guard the data kept in the root of a shared registry (types, ext)
+ * against other threads. No-ops for a private state. */
+extern void DLLEXPORT varLock(StateManager_t statePtr);
+extern void DLLEXPORT varUnlock(StateManager_t statePtr);
+
 /* function to initialize state for a variable type */
 extern int DLLEXPORT InitializeStateManager(Tcl_Interp *interp, const char *key,
 		const char *cmd_name,
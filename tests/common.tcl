@@ -0,0 +1,24 @@
+# Setup shared by the test files, each of which sources it first. ctest
+# runs them with the paths of the test type modules (built from
+# testtypes.c and testcxx.cpp) in the TESTTYPES and TESTCXX environment
+# variables. Only the first is loaded here.
+
+package require tcltest 2
+namespace import ::tcltest::*
+
+set testtypes [file normalize $env(TESTTYPES)]
+load $testtypes Testtypes
+
+# a fresh interpreter with the test types loaded
+proc newInterp {} {
+	set i [interp create]
+	$i eval [list load $::testtypes Testtypes]
+	return $i
+}
+
+# ends a test file; ctest goes by the exit status
+proc finish {} {
+	set failed $::tcltest::numTests(Failed)
+	cleanupTests
+	exit [expr {$failed>0}]
+}
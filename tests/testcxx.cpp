@@ -0,0 +1,240 @@
+/*
+ * This file is part of TclStateManager module.
+ *
+ * Object types written in C++ with helperwrapper.hpp, used by the test
+ * suite (see cxx.test). Loaded with "load libtestcxx.so Testcxx".
+ *
+ * TclStateManager is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * TclStateManager is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with
+ * TclStateManager. If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+// verify the downcasts by type id against dynamic_cast
+#define COBJ_CHECKED_CASTS
+
+#include <stdexcept>
+#include <string>
+#include "helperwrapper.hpp"
+
+// instances alive, in all interpreters
+static int live = 0;
+
+// fits in the block of its cObj
+struct Small {
+    int n;
+    std::string label;
+    explicit Small(int v) : n(v), label("small") { live++; }
+    ~Small() { live--; }
+    int get(Tcl_Interp* interp, int, Tcl_Obj* CONST[]) {
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(n));
+        return TCL_OK;
+    }
+};
+
+// does not
+struct Big {
+    int n;
+    char buf[4 * COBJ_INLINE_SIZE];
+    explicit Big(int v) : n(v) { live++; }
+    ~Big() { live--; }
+    int get(Tcl_Interp* interp, int, Tcl_Obj* CONST[]) {
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(n));
+        return TCL_OK;
+    }
+};
+
+struct Shape {
+    virtual ~Shape() {}
+    virtual int sides() const = 0;
+};
+
+struct Square : Shape {
+    std::string name;
+    Square() : name("square") { live++; }
+    ~Square() { live--; }
+    int sides() const { return 4; }
+};
+
+// objects of type square are exactly Squares
+COBJ_TYPE_ID(Square, "square");
+
+// and those of type bigsquare are not
+struct BigSquare : Square {
+    int size;
+    BigSquare() : size(10) {}
+};
+
+struct Triangle : Shape {
+    Triangle() { live++; }
+    ~Triangle() { live--; }
+    int sides() const { return 3; }
+};
+
+// registered with registerType()
+struct Account {
+    std::string holder;
+    double balance;
+    Account(std::string h, double b) : holder(h), balance(b) { live++; }
+    ~Account() { live--; }
+    double deposit(double amount) { return balance += amount; }
+    int withdraw(int amount) {
+        if (amount > balance) throw std::runtime_error("insufficient funds");
+        balance -= amount;
+        return amount;
+    }
+    std::string owner() const { return holder; }
+    void reset() { balance = 0; }
+    bool rename(const char* name, bool force) {
+        if (!force && !holder.empty()) return false;
+        holder = name;
+        return true;
+    }
+};
+
+static int smallValue(int objc, Tcl_Obj* CONST objv[], Tcl_Interp* interp, int* v) {
+    *v = 0;
+    return objc > 3 ? Tcl_GetIntFromObj(interp, objv[3], v) : TCL_OK;
+}
+
+static int smallCreate(ClientData, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[], void* vo) {
+    int v;
+    if (smallValue(objc, objv, interp, &v) != TCL_OK) return TCL_ERROR;
+    emplace<Small>((cObj*)vo, v);
+    return TCL_OK;
+}
+
+static int bigCreate(ClientData, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[], void* vo) {
+    int v;
+    if (smallValue(objc, objv, interp, &v) != TCL_OK) return TCL_ERROR;
+    emplace<Big>((cObj*)vo, v);
+    return TCL_OK;
+}
+
+// the same as small, created on the heap by the type itself
+static int wrappedCreate(ClientData, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[], void* vo) {
+    int v;
+    if (smallValue(objc, objv, interp, &v) != TCL_OK) return TCL_ERROR;
+    cObj* obj = (cObj*)vo;
+    obj->object = makeWrapper(new Small(v));
+    obj->deleteFunc = deleter<Small>();
+    return TCL_OK;
+}
+
+static int squareCreate(ClientData, Tcl_Interp*, int, Tcl_Obj* CONST[], void* vo) {
+    emplaceAs<Shape, Square>((cObj*)vo);
+    return TCL_OK;
+}
+
+static int bigSquareCreate(ClientData, Tcl_Interp*, int, Tcl_Obj* CONST[], void* vo) {
+    emplaceAs<Shape, BigSquare>((cObj*)vo);
+    return TCL_OK;
+}
+
+static int triangleCreate(ClientData, Tcl_Interp*, int, Tcl_Obj* CONST[], void* vo) {
+    emplaceAs<Shape, Triangle>((cObj*)vo);
+    return TCL_OK;
+}
+
+static int shapeSides(ClientData data, Tcl_Interp* interp, int, Tcl_Obj* CONST[]) {
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(getFrom<Shape>(data)->sides()));
+    return TCL_OK;
+}
+
+// whether the object is of type square, going by the type id
+static int shapeIsSquare(ClientData data, Tcl_Interp* interp, int, Tcl_Obj* CONST[]) {
+    bool square = getFrom<Shape, Square>(data) != NULL;
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(square));
+    return TCL_OK;
+}
+
+// whether the object is a Triangle, which has no type id
+static int shapeIsTriangle(ClientData data, Tcl_Interp* interp, int, Tcl_Obj* CONST[]) {
+    bool triangle = getFrom<Shape, Triangle>(data) != NULL;
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(triangle));
+    return TCL_OK;
+}
+
+// whether the instance lives in the block of its cObj
+static int inlineMethod(ClientData data, Tcl_Interp* interp, int, Tcl_Obj* CONST[]) {
+    bool inlined = (((ObjCmdClientData*)data)->mSelf->flags & COBJ_FLAG_INLINE) != 0;
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(inlined));
+    return TCL_OK;
+}
+
+static const cObjMethod smallMethods[] = {
+    { "get", method<Small, &Small::get> },
+    { "inline", inlineMethod },
+    { NULL, NULL }
+};
+
+static const cObjMethod bigMethods[] = {
+    { "get", method<Big, &Big::get> },
+    { "inline", inlineMethod },
+    { NULL, NULL }
+};
+
+static const cObjMethod shapeMethods[] = {
+    { "inline", inlineMethod },
+    { "issquare", shapeIsSquare },
+    { "istriangle", shapeIsTriangle },
+    { "sides", shapeSides },
+    { NULL, NULL }
+};
+
+// testbadid: register Squares under a name other than their type id
+static int testBadIdCmd(ClientData, Tcl_Interp* interp, int, Tcl_Obj* CONST[]) {
+    return registerType<Square>(interp, "oddsquare", {});
+}
+
+// testlive: the number of instances alive
+static int testLiveCmd(ClientData, Tcl_Interp* interp, int, Tcl_Obj* CONST[]) {
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(live));
+    return TCL_OK;
+}
+
+extern "C" int Testcxx_Init(Tcl_Interp* interp) {
+    cObjType* slowPtr = NULL;
+    if (cObjState_Init(interp) != TCL_OK) return TCL_ERROR;
+    if (registerNewTypeMethods(interp, "small", smallCreate, smallMethods,
+                NULL, NULL) != TCL_OK
+            || registerNewTypeMethods(interp, "big", bigCreate, bigMethods,
+                NULL, NULL) != TCL_OK
+            || registerNewTypeMethods(interp, "slowsmall", smallCreate, smallMethods,
+                NULL, &slowPtr) != TCL_OK
+            || registerNewTypeMethods(interp, "wrapped", wrappedCreate, smallMethods,
+                NULL, NULL) != TCL_OK
+            || registerNewTypeMethods(interp, "square", squareCreate, shapeMethods,
+                NULL, NULL) != TCL_OK
+            || registerNewTypeMethods(interp, "bigsquare", bigSquareCreate, shapeMethods,
+                NULL, NULL) != TCL_OK
+            || registerNewTypeMethods(interp, "triangle", triangleCreate, shapeMethods,
+                NULL, NULL) != TCL_OK)
+        return TCL_ERROR;
+    slowPtr->flags |= COBJ_TYPE_ASYNC_DELETE;
+    if (registerType<Account, std::string, double>(interp, "account", {
+                COBJ_METHOD(Account, deposit),
+                COBJ_METHOD(Account, owner),
+                COBJ_METHOD(Account, rename),
+                COBJ_METHOD_AS(Account, reset, "clear"),
+                COBJ_METHOD(Account, withdraw) }) != TCL_OK)
+        return TCL_ERROR;
+    Tcl_CreateObjCommand(interp, "testbadid", testBadIdCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "testlive", testLiveCmd, NULL, NULL);
+    return TCL_OK;
+}
@@ -0,0 +1,465 @@
+/*
+ * This file is part of TclStateManager module.
+ *
+ * Object types used by the test suite (see common.tcl). Loaded with
+ * "load libtesttypes.so Testtypes" after cObjState_Init().
+ *
+ * TclStateManager is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * TclStateManager is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with
+ * TclStateManager. If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <tcl.h>
+#include "cobj_state.h"
+
+/* deleteFuncs run so far, in all threads */
+static long freed=0;
+TCL_DECLARE_MUTEX(freedMutex)
+
+static void counterFree(void *ptr)
+{
+	Tcl_MutexLock(&freedMutex);
+	freed++;
+	Tcl_MutexUnlock(&freedMutex);
+	ckfree((char*)ptr);
+}
+
+/* creates to go before one fails, or -1 */
+static int failAfter=-1;
+
+/* cobj create counter|gauge|slowcounter ?value? */
+static int counterCreate(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[], void *ptr)
+{
+	cObj *oPtr=(cObj*)ptr;
+	int value=0;
+	(void)data;
+	if (failAfter>=0 && failAfter--==0) {
+		Tcl_AppendResult(interp,"create failed",NULL);
+		return TCL_ERROR;
+	}
+	if (objc>3 && Tcl_GetIntFromObj(interp,objv[3],&value)!=TCL_OK)
+		return TCL_ERROR;
+	oPtr->object=ckalloc(sizeof(int));
+	*(int*)oPtr->object=value;
+	oPtr->deleteFunc=counterFree;
+	return TCL_OK;
+}
+
+static int counterGet(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	ObjCmdClientData *cdata=(ObjCmdClientData*)data;
+	(void)objc;
+	(void)objv;
+	Tcl_SetObjResult(interp,Tcl_NewIntObj(*(int*)cdata->mSelf->object));
+	return TCL_OK;
+}
+
+static int counterIncr(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	ObjCmdClientData *cdata=(ObjCmdClientData*)data;
+	(void)objc;
+	(void)objv;
+	Tcl_SetObjResult(interp,Tcl_NewIntObj(++*(int*)cdata->mSelf->object));
+	return TCL_OK;
+}
+
+/* a method of the types testregister makes, returning its name as called */
+static int counterEcho(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	(void)data;
+	(void)objc;
+	Tcl_SetObjResult(interp,objv[1]);
+	return TCL_OK;
+}
+
+/* fails with the word the method was invoked with */
+static int counterFail(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	(void)data;
+	(void)objc;
+	Tcl_SetObjResult(interp,objv[0]);
+	return TCL_ERROR;
+}
+
+/* not sorted, registerNewTypeMethods() does that */
+static const cObjMethod counterMethods[]={
+	{"incr",counterIncr},
+	{"fail",counterFail},
+	{"get",counterGet},
+	{NULL,NULL}
+};
+
+/* The instance command of gauges, and of the types testregister makes
+ * with -fallback:
+ * $g get
+ * $g incr
+ * $g reset */
+static int gaugeCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	static const char *methods[]={"get","incr","reset",NULL};
+	enum methods {GetIx, IncrIx, ResetIx};
+	ObjCmdClientData *cdata=(ObjCmdClientData*)data;
+	int *valuePtr=(int*)cdata->mSelf->object;
+	int index;
+	(void)objc;
+	if (Tcl_GetIndexFromObj(interp,objv[1],methods,"method",0,&index)!=TCL_OK)
+		return TCL_ERROR;
+	if (index==IncrIx) ++*valuePtr;
+	if (index==ResetIx) *valuePtr=0;
+	cObjUpdateSize(cdata->mSelf);
+	Tcl_SetObjResult(interp,Tcl_NewIntObj(*valuePtr));
+	return TCL_OK;
+}
+
+/* the sizeFunc of gauges: a byte per unit of their value */
+static size_t gaugeSize(void *object)
+{
+	int value=*(int*)object;
+	return value>0 ? (size_t)value : 0;
+}
+
+/* testfreed: the number of deleteFuncs run */
+static int testFreedCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	long n;
+	(void)data;
+	(void)objc;
+	(void)objv;
+	Tcl_MutexLock(&freedMutex);
+	n=freed;
+	Tcl_MutexUnlock(&freedMutex);
+	Tcl_SetObjResult(interp,Tcl_NewLongObj(n));
+	return TCL_OK;
+}
+
+/* testfailcreate <n>: make the create after the next n fail */
+static int testFailCreateCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	(void)data;
+	if (objc!=2) {
+		Tcl_WrongNumArgs(interp,1,objv,"n");
+		return TCL_ERROR;
+	}
+	return Tcl_GetIntFromObj(interp,objv[1],&failAfter);
+}
+
+/* testlookup <handle> ?<type>? ?name|type|hash?
+ * The value of a counter found with getcObjFromObj(), getcObjFromObjType()
+ * or getcObjFromObjHash(), checking for type (by default counter). */
+static int testLookupCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	static const char *options[]={"name","type","hash",NULL};
+	enum options {NameIx, TypeIx, HashIx};
+	const char *type_name="counter";
+	cObjType *typePtr=NULL;
+	cObj *oPtr=NULL;
+	int index=NameIx, code;
+	(void)data;
+	if (objc<2 || objc>4) {
+		Tcl_WrongNumArgs(interp,1,objv,"handle ?type? ?name|type|hash?");
+		return TCL_ERROR;
+	}
+	if (objc>2) type_name=Tcl_GetString(objv[2]);
+	if (objc>3 && Tcl_GetIndexFromObj(interp,objv[3],options,"option",0,&index)!=TCL_OK)
+		return TCL_ERROR;
+	switch (index) {
+		case TypeIx:
+			if (cObjGetType(interp,type_name,&typePtr)!=TCL_OK) return TCL_ERROR;
+			code=getcObjFromObjType(interp,objv[1],typePtr,&oPtr);
+			break;
+		case HashIx:
+			code=getcObjFromObjHash(interp,objv[1],TYPEHASH(type_name,-1),&oPtr);
+			break;
+		default:
+			code=getcObjFromObj(interp,objv[1],type_name,&oPtr);
+			break;
+	}
+	if (code!=TCL_OK) return TCL_ERROR;
+	Tcl_SetObjResult(interp,Tcl_NewIntObj(*(int*)oPtr->object));
+	return TCL_OK;
+}
+
+/* testregister <name> ?-fallback? ?method ...?
+ * testregister <name> -gauge
+ * Register a type like counter with the given methods (get or incr, by
+ * default both). Methods named like the builtins (release, retain or
+ * type) return the name they were called by. With -fallback, gaugeCmd handles the other methods.
+ * With -gauge, the type is registered like gauge. */
+static int testRegisterCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	cObjMethod methods[8];
+	InstanceCommandFunc fallback=NULL;
+	const char *name;
+	int i=2, n=0;
+	(void)data;
+	if (objc<2) {
+		Tcl_WrongNumArgs(interp,1,objv,"name ?-fallback|-gauge? ?method ...?");
+		return TCL_ERROR;
+	}
+	if (objc==3 && strcmp(Tcl_GetString(objv[2]),"-gauge")==0)
+		return registerNewTypeEx(interp,Tcl_GetString(objv[1]),counterCreate,
+				gaugeCmd,NULL);
+	if (objc>2 && strcmp(Tcl_GetString(objv[2]),"-fallback")==0) {
+		fallback=gaugeCmd;
+		i++;
+	}
+	if (i==objc)
+		return registerNewTypeMethods(interp,Tcl_GetString(objv[1]),counterCreate,
+				counterMethods,fallback,NULL);
+	for (;i<objc && n<7;i++,n++) {
+		name=Tcl_GetString(objv[i]);
+		methods[n].name=name;
+		if (strcmp(name,"get")==0) methods[n].proc=counterGet;
+		else if (strcmp(name,"incr")==0) methods[n].proc=counterIncr;
+		else if (strcmp(name,"release")==0 || strcmp(name,"retain")==0
+				|| strcmp(name,"type")==0)
+			methods[n].proc=counterEcho;
+		else {
+			Tcl_AppendResult(interp,"no method \"",name,"\"",NULL);
+			return TCL_ERROR;
+		}
+	}
+	methods[n].name=NULL;
+	methods[n].proc=NULL;
+	return registerNewTypeMethods(interp,Tcl_GetString(objv[1]),counterCreate,
+			methods,fallback,NULL);
+}
+
+/* counters retained by testhold */
+static cObj *held[16];
+static int numHeld=0;
+
+/* testhold <handle>: retain a counter from C */
+static int testHoldCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	cObj *oPtr=NULL;
+	(void)data;
+	if (objc!=2) {
+		Tcl_WrongNumArgs(interp,1,objv,"handle");
+		return TCL_ERROR;
+	}
+	if (numHeld==16) {
+		Tcl_AppendResult(interp,"too many held",NULL);
+		return TCL_ERROR;
+	}
+	if (getcObjFromObj(interp,objv[1],"counter",&oPtr)!=TCL_OK)
+		return TCL_ERROR;
+	cObjRetain(oPtr);
+	held[numHeld++]=oPtr;
+	return TCL_OK;
+}
+
+/* testdrop: release the counters retained by testhold, returning the
+ * sum of their values */
+static int testDropCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	int sum=0;
+	(void)data;
+	(void)objc;
+	(void)objv;
+	while (numHeld>0) {
+		numHeld--;
+		sum+=*(int*)held[numHeld]->object;
+		cObjRelease(held[numHeld]);
+	}
+	Tcl_SetObjResult(interp,Tcl_NewIntObj(sum));
+	return TCL_OK;
+}
+
+/* A thread with an interpreter using cobj, for transfers without the
+ * Thread package. It only services its events when asked to eval. */
+typedef struct TestThread {
+	Tcl_ThreadId id;
+	int op; /* TEST_THREAD_* asked of the thread, reset once done */
+	const char *script;
+	char *result;
+	int code;
+	struct TestThread *next;
+} TestThread;
+
+#define TEST_THREAD_NONE 0
+#define TEST_THREAD_EVAL 1
+#define TEST_THREAD_EXIT 2
+
+TCL_DECLARE_MUTEX(threadMutex)
+static Tcl_Condition threadCond;
+static TestThread *threads=NULL;
+
+int Testtypes_Init(Tcl_Interp *interp);
+
+static Tcl_ThreadCreateType testThreadProc(ClientData data)
+{
+	TestThread *t=(TestThread*)data;
+	Tcl_Interp *interp=Tcl_CreateInterp();
+	const char *result;
+	int code=Testtypes_Init(interp);
+	Tcl_MutexLock(&threadMutex);
+	t->code=code;
+	t->op=TEST_THREAD_NONE;
+	Tcl_ConditionNotify(&threadCond);
+	while (code==TCL_OK) {
+		while (t->op==TEST_THREAD_NONE)
+			Tcl_ConditionWait(&threadCond,&threadMutex,NULL);
+		if (t->op==TEST_THREAD_EXIT) break;
+		Tcl_MutexUnlock(&threadMutex);
+		while (Tcl_DoOneEvent(TCL_ALL_EVENTS|TCL_DONT_WAIT)) ;
+		code=Tcl_EvalEx(interp,t->script,-1,TCL_EVAL_GLOBAL);
+		result=Tcl_GetStringResult(interp);
+		Tcl_MutexLock(&threadMutex);
+		t->code=code;
+		t->result=ckalloc(strlen(result)+1);
+		strcpy(t->result,result);
+		t->op=TEST_THREAD_NONE;
+		code=TCL_OK;
+		Tcl_ConditionNotify(&threadCond);
+	}
+	Tcl_MutexUnlock(&threadMutex);
+	Tcl_DeleteInterp(interp);
+	Tcl_FinalizeThread();
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* hand op to the thread and wait until it is done */
+static void testThreadAsk(TestThread *t, int op)
+{
+	Tcl_MutexLock(&threadMutex);
+	t->op=op;
+	Tcl_ConditionNotify(&threadCond);
+	if (op==TEST_THREAD_EVAL) {
+		while (t->op!=TEST_THREAD_NONE)
+			Tcl_ConditionWait(&threadCond,&threadMutex,NULL);
+	}
+	Tcl_MutexUnlock(&threadMutex);
+}
+
+/* testthread create
+ * testthread eval <id> <script>
+ * testthread exit <id>
+ * Ids have the form of those of the Thread package. A thread runs the
+ * events queued to it before each eval; exit drops them. */
+static int testThreadCmd(ClientData data, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	static const char *options[]={"create","eval","exit",NULL};
+	enum options {CreateIx, EvalIx, ExitIx};
+	TestThread *t=NULL, **pp;
+	void *ptr=NULL;
+	char buf[TCL_INTEGER_SPACE+4];
+	int index, code, joined;
+	(void)data;
+	if (objc<2) {
+		Tcl_WrongNumArgs(interp,1,objv,"option ?arg ...?");
+		return TCL_ERROR;
+	}
+	if (Tcl_GetIndexFromObj(interp,objv[1],options,"option",0,&index)!=TCL_OK)
+		return TCL_ERROR;
+	if (index==CreateIx) {
+		t=(TestThread*)ckalloc(sizeof(TestThread));
+		t->op=TEST_THREAD_EVAL; /* busy until it is up */
+		t->script=NULL;
+		t->result=NULL;
+		Tcl_MutexLock(&threadMutex);
+		if (Tcl_CreateThread(&t->id,testThreadProc,(ClientData)t,
+					TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)!=TCL_OK) {
+			Tcl_MutexUnlock(&threadMutex);
+			ckfree((char*)t);
+			Tcl_AppendResult(interp,"can't create a thread",NULL);
+			return TCL_ERROR;
+		}
+		while (t->op!=TEST_THREAD_NONE)
+			Tcl_ConditionWait(&threadCond,&threadMutex,NULL);
+		code=t->code;
+		Tcl_MutexUnlock(&threadMutex);
+		if (code!=TCL_OK) {
+			Tcl_JoinThread(t->id,&joined);
+			ckfree((char*)t);
+			Tcl_AppendResult(interp,"can't load the test types in the thread",NULL);
+			return TCL_ERROR;
+		}
+		t->next=threads;
+		threads=t;
+		sprintf(buf,"tid%p",(void*)t->id);
+		Tcl_SetObjResult(interp,Tcl_NewStringObj(buf,-1));
+		return TCL_OK;
+	}
+	if (objc!=(index==EvalIx ? 4 : 3)) {
+		Tcl_WrongNumArgs(interp,2,objv,index==EvalIx ? "id script" : "id");
+		return TCL_ERROR;
+	}
+	if (sscanf(Tcl_GetString(objv[2]),"tid%p",&ptr)==1) {
+		for (pp=&threads;*pp!=NULL;pp=&(*pp)->next) {
+			if ((*pp)->id==(Tcl_ThreadId)ptr) {
+				t=*pp;
+				break;
+			}
+		}
+	}
+	if (t==NULL) {
+		Tcl_AppendResult(interp,"no test thread \"",Tcl_GetString(objv[2]),"\"",NULL);
+		return TCL_ERROR;
+	}
+	if (index==ExitIx) {
+		*pp=t->next;
+		testThreadAsk(t,TEST_THREAD_EXIT);
+		Tcl_JoinThread(t->id,&joined);
+		ckfree((char*)t);
+		return TCL_OK;
+	}
+	t->script=Tcl_GetString(objv[3]);
+	testThreadAsk(t,TEST_THREAD_EVAL);
+	Tcl_SetObjResult(interp,Tcl_NewStringObj(t->result,-1));
+	ckfree(t->result);
+	t->result=NULL;
+	return t->code;
+}
+
+int Testtypes_Init(Tcl_Interp *interp)
+{
+	cObjType *typePtr=NULL, *gaugePtr=NULL, *slowPtr=NULL;
+	if (cObjState_Init(interp)!=TCL_OK) return TCL_ERROR;
+	if (registerNewTypeMethods(interp,"counter",counterCreate,counterMethods,
+				NULL,&typePtr)!=TCL_OK
+			|| registerNewTypeEx(interp,"gauge",counterCreate,gaugeCmd,
+				&gaugePtr)!=TCL_OK
+			|| registerNewTypeMethods(interp,"slowcounter",counterCreate,
+				counterMethods,NULL,&slowPtr)!=TCL_OK)
+		return TCL_ERROR;
+	typePtr->flags|=COBJ_TYPE_THREAD_SAFE;
+	gaugePtr->sizeFunc=gaugeSize;
+	slowPtr->flags|=COBJ_TYPE_ASYNC_DELETE;
+	Tcl_CreateObjCommand(interp,"testfailcreate",testFailCreateCmd,NULL,NULL);
+	Tcl_CreateObjCommand(interp,"testdrop",testDropCmd,NULL,NULL);
+	Tcl_CreateObjCommand(interp,"testfreed",testFreedCmd,NULL,NULL);
+	Tcl_CreateObjCommand(interp,"testhold",testHoldCmd,NULL,NULL);
+	Tcl_CreateObjCommand(interp,"testlookup",testLookupCmd,NULL,NULL);
+	Tcl_CreateObjCommand(interp,"testregister",testRegisterCmd,NULL,NULL);
+	Tcl_CreateObjCommand(interp,"testthread",testThreadCmd,NULL,NULL);
+	return TCL_OK;
+}